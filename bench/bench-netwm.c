@@ -0,0 +1,161 @@
+/*
+ * Micro-benchmark for _NET_WM_ICON to cairo ARGB32 conversion. Times the
+ * float loop get_icon_from_netwm used before and the netwm_to_argb32
+ * kernels on a 256x256 icon, which holds every (color, alpha) pair. Exits
+ * with non-zero status if any kernel differs from the exact c*a/255 rounding
+ * or the float loop is off by more than one (it truncates).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "netwm-icon.h"
+
+#define ICON_SIZE 256
+#define PIXELS (ICON_SIZE * ICON_SIZE)
+#define ROUNDS 1000
+
+typedef void (*kernel_t)(uint32_t*, const long*, size_t);
+
+/* the conversion as it was before netwm_to_argb32 */
+static void netwm_to_argb32_float(uint32_t *dst, const long *src, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		unsigned char *a, *d;
+		a = (unsigned char*)&dst[i];
+		d = (unsigned char*)&src[i];
+		a[0] = d[0];
+		a[1] = d[1];
+		a[2] = d[2];
+		a[3] = d[3];
+		/* premultiply alpha */
+		a[0] *= (float)d[3] / 255.0f;
+		a[1] *= (float)d[3] / 255.0f;
+		a[2] *= (float)d[3] / 255.0f;
+	}
+}
+
+static void netwm_to_argb32_exact(uint32_t *dst, const long *src, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		uint32_t p = src[i];
+		uint32_t a = p >> 24;
+		uint32_t r = ((p >> 16 & 0xFF) * a + 127) / 255;
+		uint32_t g = ((p >> 8 & 0xFF) * a + 127) / 255;
+		uint32_t b = ((p & 0xFF) * a + 127) / 255;
+		dst[i] = a << 24 | r << 16 | g << 8 | b;
+	}
+}
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int max_channel_diff(uint32_t a, uint32_t b)
+{
+	int i, ret = 0;
+	for (i = 0; i < 32; i += 8) {
+		int d = (int)(a >> i & 0xFF) - (int)(b >> i & 0xFF);
+		if (d < 0)
+			d = -d;
+		if (d > ret)
+			ret = d;
+	}
+	return ret;
+}
+
+/* returns the number of pixels differing by more than "tolerance" */
+static int check(const char *name, kernel_t kernel, const long *src,
+		 const uint32_t *expected, size_t n, int tolerance)
+{
+	uint32_t *dst = malloc(sizeof(uint32_t) * n);
+	size_t i;
+	int bad = 0;
+
+	memset(dst, 0, sizeof(uint32_t) * n);
+	(*kernel)(dst, src, n);
+	for (i = 0; i < n; ++i) {
+		if (max_channel_diff(dst[i], expected[i]) <= tolerance)
+			continue;
+		if (!bad)
+			fprintf(stderr, "%s: pixel %zu: %08x, expected %08x\n",
+				name, i, dst[i], expected[i]);
+		bad++;
+	}
+	free(dst);
+	return bad;
+}
+
+static void bench(const char *name, kernel_t kernel, const long *src)
+{
+	uint32_t *dst = malloc(sizeof(uint32_t) * PIXELS);
+	double start;
+	int i;
+
+	(*kernel)(dst, src, PIXELS);
+	start = now_ms();
+	for (i = 0; i < ROUNDS; ++i)
+		(*kernel)(dst, src, PIXELS);
+	printf("%-8s %8.4f ms\n", name, (now_ms() - start) / ROUNDS);
+	free(dst);
+}
+
+int main(int argc, char **argv)
+{
+	long *src = malloc(sizeof(long) * PIXELS);
+	uint32_t *expected = malloc(sizeof(uint32_t) * PIXELS);
+	int bad = 0;
+	size_t i;
+
+	/* alpha by row, color by column, garbage in the high half of longs */
+	for (i = 0; i < PIXELS; ++i) {
+		uint32_t a = i / ICON_SIZE;
+		uint32_t c = i % ICON_SIZE;
+		unsigned long p = a << 24 | c << 16 | (255 - c) << 8 | (c ^ 0x5A);
+		if (sizeof(long) > 4)
+			p |= (unsigned long)0xDEADBEEF << 16 << 16;
+		src[i] = (long)p;
+	}
+	netwm_to_argb32_exact(expected, src, PIXELS);
+
+	/* odd lengths go through the scalar tails of vector kernels */
+	bad += check("float", netwm_to_argb32_float, src, expected, PIXELS, 1);
+	bad += check("scalar", netwm_to_argb32_scalar, src, expected, PIXELS, 0);
+	bad += check("scalar", netwm_to_argb32_scalar, src, expected, PIXELS-3, 0);
+#ifdef NETWM_ICON_SIMD
+	__builtin_cpu_init();
+	bad += check("sse2", netwm_to_argb32_sse2, src, expected, PIXELS, 0);
+	bad += check("sse2", netwm_to_argb32_sse2, src, expected, PIXELS-3, 0);
+	if (__builtin_cpu_supports("avx2")) {
+		bad += check("avx2", netwm_to_argb32_avx2, src, expected,
+			     PIXELS, 0);
+		bad += check("avx2", netwm_to_argb32_avx2, src, expected,
+			     PIXELS-7, 0);
+	}
+#endif
+	bad += check("dispatch", netwm_to_argb32, src, expected, PIXELS, 0);
+
+	printf("%dx%d icon, average of %d rounds\n", ICON_SIZE, ICON_SIZE, ROUNDS);
+	bench("float", netwm_to_argb32_float, src);
+	bench("scalar", netwm_to_argb32_scalar, src);
+#ifdef NETWM_ICON_SIMD
+	bench("sse2", netwm_to_argb32_sse2, src);
+	if (__builtin_cpu_supports("avx2"))
+		bench("avx2", netwm_to_argb32_avx2, src);
+	else
+		printf("%-8s not supported by the CPU\n", "avx2");
+#endif
+
+	free(expected);
+	free(src);
+	if (bad) {
+		fprintf(stderr, "%d pixels differ\n", bad);
+		return 1;
+	}
+	return 0;
+}
@@ -10,6 +10,7 @@
 #include "widget-utils.h"
 #include "builtin-widgets.h"
 #include "args.h"
+#include "trace.h"
 
 /**************************************************************************
   Listing themes
@@ -174,11 +175,14 @@ static int show_version;
 static int show_list;
 static const char *theme_override;
 static const char *config_override;
+static const char *record_file;
+static const char *replay_file;
 
 #define BMPANEL2_VERSION_STR "bmpanel2 version 2.1\n"
 #define BMPANEL2_USAGE \
 "usage: bmpanel2 [-h | --help] [--version] [--usage] [--list] [--theme=<theme>]\n" \
-"                [--config=<config>]\n"
+"                [--config=<config>] [--profile] [--record=<file>]\n" \
+"                [--replay=<file>]\n"
 
 static const char *bmpanel2_version_str = BMPANEL2_VERSION_STR BMPANEL2_USAGE;
 
@@ -248,6 +252,17 @@ static void sigusr2_handler(int xxx)
 	g_idle_add(reload_config_event, (gpointer)1);
 }
 
+static gboolean dump_profile_event(gpointer data)
+{
+	xprofstat();
+	return 0;
+}
+
+static void sigquit_handler(int xxx)
+{
+	g_idle_add(dump_profile_event, 0);
+}
+
 static void mysignal(int sig, void (*handler)(int))
 {
 	struct sigaction sa;
@@ -264,6 +279,9 @@ static void parse_bmpanel2_args(int argc, char **argv)
 		ARG_BOOLEAN("list", &show_list, "list available themes", 0),
 		ARG_STRING("config", &config_override, "use custom configuration file", 0),
 		ARG_STRING("theme", &theme_override, "override config theme parameter", 0),
+		ARG_BOOLEAN("profile", &profile_enabled, "collect latency histograms (dumped on SIGQUIT and at exit)", 0),
+		ARG_STRING("record", &record_file, "record X events trace to a file", 0),
+		ARG_STRING("replay", &replay_file, "replay X events trace from a file and exit", 0),
 		ARG_END
 	};
 	parse_args(args, argc, argv, bmpanel2_version_str);
@@ -280,6 +298,8 @@ static void parse_bmpanel2_args(int argc, char **argv)
 		list_themes();
 		exit(0);
 	}
+	if (record_file && replay_file)
+		XDIE("--record and --replay are mutually exclusive");
 }
 
 int main(int argc, char **argv)
@@ -289,6 +309,10 @@ int main(int argc, char **argv)
 	if (!g_thread_supported())
 		XDIE("bmpanel2 requires glib with thread support enabled");
 	parse_bmpanel2_args(argc, argv);
+	if (record_file)
+		trace_open(record_file, TRACE_RECORD);
+	if (replay_file)
+		trace_open(replay_file, TRACE_REPLAY);
 	load_settings(config_override);
 	if (load_theme(&theme, theme_override) < 0)
 		XDIE("Failed to load theme");
@@ -300,14 +324,22 @@ int main(int argc, char **argv)
 	mysignal(SIGTERM, sigterm_handler);
 	mysignal(SIGUSR1, sigusr1_handler);
 	mysignal(SIGUSR2, sigusr2_handler);
+	if (profile_enabled)
+		mysignal(SIGQUIT, sigquit_handler);
 
-	panel_main_loop(&p);
+	if (replay_file)
+		panel_replay_trace(&p);
+	else
+		panel_main_loop(&p);
 
 	free_panel(&p);
+	trace_close();
 	free_config_format_tree(&theme);
 	clean_static_buf();
 	clean_image_cache(1);
 	free_settings();
+	xprofstat();
+	free_profile();
 	xmemstat(0, 0, 1);
 	return EXIT_SUCCESS;
 }
@@ -26,11 +26,22 @@ struct taskbar_task {
 	int demands_attention;
 	int monitor; /* for multihead setups */
 
+	/* icons are loaded when the task becomes visible and may be evicted
+	 * while it's hidden, see update_task_icons */
+	size_t icon_bytes;
+	unsigned int last_visible; /* taskbar_widget::visibility_clock */
+
 	/* I'm using only one name source Atom and I'm watching it for
 	 * updates.
 	 */
 	Atom name_atom;
 	Atom name_type_atom;
+
+	/* last rendered button, valid while state and width are the same,
+	 * dropped on name or icon change */
+	cairo_surface_t *button;
+	int button_state;
+	int button_w;
 };
 
 struct taskbar_state {
@@ -69,6 +80,9 @@ struct taskbar_widget {
 	int task_death_threshold;
 	int task_urgency_hint;
 	unsigned int task_visible_monitors;
+	size_t task_icon_memory; /* bytes, zero means no limit */
+
+	unsigned int visibility_clock;
 };
 
 extern struct widget_interface taskbar_interface;
@@ -85,6 +99,7 @@ struct clock_theme {
 
 struct clock_widget {
 	struct clock_theme theme;
+	int has_seconds; /* time_format shows seconds, tick every second */
 
 	/* parameters from bmpanel2rc */
 	char *clock_prog;
@@ -193,6 +208,8 @@ struct pager_widget {
 	GHashTable *tasks; /* synced table of windows with retrieved parameters */
 
 	int current_monitor_only;
+
+	struct rect_batch batch;
 };
 
 extern struct widget_interface pager_interface;
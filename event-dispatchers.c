@@ -1,4 +1,156 @@
 #include "gui.h"
+#include "array.h"
+
+/**************************************************************************
+  Dispatch tables
+**************************************************************************/
+
+void widget_select_prop(struct widget *w, int where, Atom atom)
+{
+	size_t i;
+	for (i = 0; i < w->prop_interests_n; ++i) {
+		struct widget_prop_interest *pi = &w->prop_interests[i];
+		if (pi->where == where && pi->atom == atom)
+			return;
+	}
+
+	struct widget_prop_interest pi = {where, atom};
+	ARRAY_APPEND(w->prop_interests, pi);
+}
+
+void free_widget_prop_interests(struct widget *w)
+{
+	FREE_ARRAY(w->prop_interests);
+}
+
+static void add_handler(struct panel *p, int type, struct widget *w)
+{
+	struct widget_list *l = &p->handlers[type];
+	l->widgets[l->widgets_n++] = w;
+}
+
+/* should be called each time the set of panel widgets is changed */
+void build_dispatch_tables(struct panel *p)
+{
+	size_t i, j;
+
+	free_dispatch_tables(p);
+	for (i = 0; i < 2; ++i)
+		p->prop_tables[i] = g_hash_table_new(g_direct_hash,
+						     g_direct_equal);
+
+	for (i = 0; i < p->widgets_n; ++i) {
+		struct widget *w = &p->widgets[i];
+		struct widget_interface *wi = w->interface;
+		unsigned int bit = 1U << i;
+
+		if (wi->client_msg)
+			add_handler(p, DISP_CLIENT_MSG, w);
+		if (wi->win_destroy)
+			add_handler(p, DISP_WIN_DESTROY, w);
+		if (wi->configure)
+			add_handler(p, DISP_CONFIGURE, w);
+		if (wi->clock_tick)
+			add_handler(p, DISP_CLOCK_TICK, w);
+		if (wi->panel_exposed)
+			add_handler(p, DISP_PANEL_EXPOSED, w);
+
+		if (!w->interface->prop_change)
+			continue;
+		if (!w->prop_interests_n) {
+			p->prop_wildcards |= bit;
+			continue;
+		}
+		for (j = 0; j < w->prop_interests_n; ++j) {
+			struct widget_prop_interest *pi = &w->prop_interests[j];
+			GHashTable *t = p->prop_tables[pi->where];
+			gpointer key = GUINT_TO_POINTER(pi->atom);
+			unsigned int mask = GPOINTER_TO_UINT(
+					g_hash_table_lookup(t, key));
+			g_hash_table_insert(t, key, GUINT_TO_POINTER(mask | bit));
+		}
+	}
+}
+
+void free_dispatch_tables(struct panel *p)
+{
+	size_t i;
+	for (i = 0; i < 2; ++i) {
+		if (p->prop_tables[i])
+			g_hash_table_destroy(p->prop_tables[i]);
+		p->prop_tables[i] = 0;
+	}
+	p->prop_wildcards = 0;
+
+	for (i = 0; i < DISP_HANDLERS_COUNT; ++i)
+		p->handlers[i].widgets_n = 0;
+}
+
+/* returns widget bit in dispatch masks or 0 if it's not a panel widget
+ * (e.g. a stashed one during reconfiguration) */
+static unsigned int widget_bit(struct widget *w)
+{
+	struct panel *p = w->panel;
+	if (w < p->widgets || w >= p->widgets + PANEL_MAX_WIDGETS)
+		return 0;
+	return 1U << (w - p->widgets);
+}
+
+/* Widgets should track client windows they want to receive ConfigureNotify
+ * and DestroyNotify events for, events of other windows are dropped. */
+void panel_track_window(struct widget *w, Window win)
+{
+	struct panel *p = w->panel;
+	unsigned int bit = widget_bit(w);
+	if (!bit)
+		return;
+
+	if (!p->tracked_windows)
+		p->tracked_windows = g_hash_table_new(g_direct_hash,
+						      g_direct_equal);
+	gpointer key = GUINT_TO_POINTER(win);
+	unsigned int mask = GPOINTER_TO_UINT(
+			g_hash_table_lookup(p->tracked_windows, key));
+	g_hash_table_insert(p->tracked_windows, key,
+			    GUINT_TO_POINTER(mask | bit));
+}
+
+void panel_untrack_window(struct widget *w, Window win)
+{
+	struct panel *p = w->panel;
+	unsigned int bit = widget_bit(w);
+	if (!bit || !p->tracked_windows)
+		return;
+
+	gpointer key = GUINT_TO_POINTER(win);
+	unsigned int mask = GPOINTER_TO_UINT(
+			g_hash_table_lookup(p->tracked_windows, key));
+	mask &= ~bit;
+	if (mask)
+		g_hash_table_insert(p->tracked_windows, key,
+				    GUINT_TO_POINTER(mask));
+	else
+		g_hash_table_remove(p->tracked_windows, key);
+}
+
+void clear_tracked_windows(struct panel *p)
+{
+	if (p->tracked_windows)
+		g_hash_table_destroy(p->tracked_windows);
+	p->tracked_windows = 0;
+}
+
+static unsigned int get_window_trackers(struct panel *p, Window win)
+{
+	if (!p->tracked_windows)
+		return 0;
+	return GPOINTER_TO_UINT(g_hash_table_lookup(p->tracked_windows,
+						    GUINT_TO_POINTER(win)));
+}
+
+/**************************************************************************
+  Dispatchers
+**************************************************************************/
 
 static inline int point_in_rect(int px, int py, int x, int y, int w, int h)
 {
@@ -78,6 +230,7 @@ void disp_motion_notify(struct panel *p, XMotionEvent *e)
 					(*w->interface->mouse_enter)(w);
 			}
 			widget_under_mouse = 1;
+			break;
 		}
 	}
 	if (!widget_under_mouse) {
@@ -132,40 +285,66 @@ void disp_enter_leave_notify(struct panel *p, XCrossingEvent *e)
 
 void disp_property_notify(struct panel *p, XPropertyEvent *e)
 {
+	int where = WIDGET_PROP_CLIENT;
+	if (e->window == p->connection.root)
+		where = WIDGET_PROP_ROOT;
+
+	unsigned int mask = p->prop_wildcards;
+	if (p->prop_tables[where])
+		mask |= GPOINTER_TO_UINT(g_hash_table_lookup(
+				p->prop_tables[where],
+				GUINT_TO_POINTER(e->atom)));
+	if (!mask)
+		return;
+
 	size_t i;
 	for (i = 0; i < p->widgets_n; ++i) {
 		struct widget *w = &p->widgets[i];
-		if (w->interface->prop_change)
+		if (mask & (1U << i)) {
+			struct profile_scope ps;
+			PROFILE_BEGIN(&ps, "prop_change", w->interface->theme_name);
 			(*w->interface->prop_change)(w, e);
+			PROFILE_END(&ps);
+		}
 	}
 }
 
 void disp_client_msg(struct panel *p, XClientMessageEvent *e)
 {
+	struct widget_list *l = &p->handlers[DISP_CLIENT_MSG];
 	size_t i;
-	for (i = 0; i < p->widgets_n; ++i) {
-		struct widget *w = &p->widgets[i];
-		if (w->interface->client_msg)
-			(*w->interface->client_msg)(w, e);
+	for (i = 0; i < l->widgets_n; ++i) {
+		struct widget *w = l->widgets[i];
+		(*w->interface->client_msg)(w, e);
 	}
 }
 
 void disp_win_destroy(struct panel *p, XDestroyWindowEvent *e)
 {
+	unsigned int mask = get_window_trackers(p, e->window);
+	if (!mask)
+		return;
+
+	struct widget_list *l = &p->handlers[DISP_WIN_DESTROY];
 	size_t i;
-	for (i = 0; i < p->widgets_n; ++i) {
-		struct widget *w = &p->widgets[i];
-		if (w->interface->win_destroy)
+	for (i = 0; i < l->widgets_n; ++i) {
+		struct widget *w = l->widgets[i];
+		if (mask & widget_bit(w))
 			(*w->interface->win_destroy)(w, e);
 	}
 }
 
 void disp_configure(struct panel *p, XConfigureEvent *e)
 {
+	unsigned int mask = get_window_trackers(p, e->window);
+	if (!mask)
+		return;
+
+	struct widget_list *l = &p->handlers[DISP_CONFIGURE];
 	size_t i;
-	for (i = 0; i < p->widgets_n; ++i) {
-		struct widget *w = &p->widgets[i];
-		if (w->interface->configure)
+	for (i = 0; i < l->widgets_n; ++i) {
+		struct widget *w = l->widgets[i];
+		if (mask & widget_bit(w))
 			(*w->interface->configure)(w, e);
 	}
 }
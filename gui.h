@@ -78,7 +78,7 @@ struct widget_interface {
 	void (*destroy_widget_private)(struct widget *w);
 	void (*draw)(struct widget *w);
 	void (*button_click)(struct widget *w, XButtonEvent *e);
-	void (*clock_tick)(struct widget *w); /* every second */
+	void (*clock_tick)(struct widget *w); /* see widget_schedule_tick */
 	void (*prop_change)(struct widget *w, XPropertyEvent *e);
 	void (*mouse_enter)(struct widget *w);
 	void (*mouse_leave)(struct widget *w);
@@ -91,6 +91,10 @@ struct widget_interface {
 	void (*dnd_drag)(struct widget *w, struct drag_info *di);
 	void (*dnd_drop)(struct widget *w, struct drag_info *di);
 
+	/* contents depend on theme and widget size only, widget is drawn once
+	 * into the panel static background layer */
+	int static_draw;
+
 	/* this is a hack, but it is required for pseudo-transparency */
 	void (*panel_exposed)(struct widget *w);
 	void (*reconfigure)(struct widget *w);
@@ -98,6 +102,16 @@ struct widget_interface {
 				   struct config_format_tree *tree);
 };
 
+/* PropertyNotify interest: a property of the root window or of a client
+ * window */
+#define WIDGET_PROP_ROOT 0
+#define WIDGET_PROP_CLIENT 1
+
+struct widget_prop_interest {
+	int where;
+	Atom atom;
+};
+
 struct widget {
 	struct widget_interface *interface;
 	struct panel *panel;
@@ -109,9 +123,29 @@ struct widget {
 	int no_separator;
 	int paint_replace; /* for transparent render */
 
+	/* last rendered contents (background included), redrawn only when
+	 * "needs_expose" is set, or the widget was moved or resized */
+	cairo_surface_t *surface;
+	int surface_x;
+	int surface_valid;
+
+	/* wall clock time (usecs) of the next clock_tick call, 0 if none */
+	gint64 next_tick;
+
+	/* PropertyNotify events the widget is interested in, if there are
+	 * none, widget receives all of them */
+	struct widget_prop_interest *prop_interests;
+	size_t prop_interests_n;
+	size_t prop_interests_alloc;
+
 	void *private; /* private part */
 };
 
+void widget_select_prop(struct widget *w, int where, Atom atom);
+void widget_schedule_tick(struct widget *w, unsigned int msec);
+void widget_cancel_tick(struct widget *w);
+void free_widget_prop_interests(struct widget *w);
+
 struct widget_interface *lookup_widget_interface(const char *themename);
 
 /* alternatives */
@@ -144,19 +178,57 @@ struct panel_theme {
 
 #define PANEL_MAX_WIDGETS 20
 
+struct widget_list {
+	struct widget *widgets[PANEL_MAX_WIDGETS];
+	size_t widgets_n;
+};
+
+/* broadcast handlers, see build_dispatch_tables */
+enum {
+	DISP_CLIENT_MSG,
+	DISP_WIN_DESTROY,
+	DISP_CONFIGURE,
+	DISP_CLOCK_TICK,
+	DISP_PANEL_EXPOSED,
+	DISP_HANDLERS_COUNT
+};
+
 struct render_interface;
 
+/* area of a shared image upload, see upload_panel_area */
+struct upload_span {
+	unsigned long serial;
+	int x, y;
+	int width, height;
+};
+
 struct panel {
 	/* X stuff */
 	Window win;
 	Pixmap bg;
 
+	/* window format, ARGB for transparent themes if possible */
+	Visual *visual;
+	int depth;
+
+	/* client-side rendering: renders upload damaged rectangles of their
+	 * image surfaces to "bg" through "upload" image */
+	int client_side_rendering;
+	struct x_image *upload;
+	GC upload_gc;
+
+	/* array, shared uploads the server hasn't completed yet */
+	struct upload_span *upload_pending;
+	size_t upload_pending_n;
+	size_t upload_pending_alloc;
+
 	/* widgets */
 	size_t widgets_n;
 	struct widget widgets[PANEL_MAX_WIDGETS];
 
 	/* "big" things */
 	struct panel_theme theme;
+	struct config_format_tree *tree; /* theme tree the panel was built from */
 	struct x_connection connection;
 	cairo_t *cr;
 	PangoLayout *layout;
@@ -175,6 +247,23 @@ struct panel {
 	/* expose flag */
 	int needs_expose;
 
+	/* background tile, separators and static widgets, rebuilt on demand
+	 * after widgets were moved or resized */
+	cairo_surface_t *static_bg;
+	int static_bg_valid;
+
+	/* redraw scheduler: at most one redraw per "frame_interval" msecs */
+	unsigned int frame_interval;
+	guint redraw_source;
+	gint64 last_redraw;
+
+	/* widget timers: one timer armed at the earliest "next_tick", it's a
+	 * timerfd watch if available, the fd lives as long as the source */
+	guint tick_source;
+	gint64 tick_deadline;
+	int tick_fd;
+	int tick_clock_set; /* wall clock was stepped */
+
 	/* event dispatching state */
 	int drag_threshold;
 
@@ -189,6 +278,18 @@ struct panel {
 	/* binded mouse actions */
 	unsigned int mbutton[3];
 
+	/* widgets implementing a handler, per DISP_* handler type */
+	struct widget_list handlers[DISP_HANDLERS_COUNT];
+
+	/* PropertyNotify routing: atom -> mask of interested widgets,
+	 * indexed by WIDGET_PROP_ROOT/WIDGET_PROP_CLIENT */
+	GHashTable *prop_tables[2];
+	unsigned int prop_wildcards;
+
+	/* ConfigureNotify and DestroyNotify routing: window -> mask of
+	 * widgets tracking it, see panel_track_window */
+	GHashTable *tracked_windows;
+
 	/* render interface */
 	struct render_interface *render;
 	void *render_private;
@@ -219,6 +320,17 @@ struct render_interface {
 
 extern struct render_interface render_normal;
 extern struct render_interface render_pseudo;
+extern struct render_interface render_composite;
+
+/* p->bg sized pixmap and its cairo context in the panel window format */
+Pixmap create_panel_pixmap(struct panel *p);
+cairo_t *create_cairo_for_panel_pixmap(struct panel *p, Pixmap pixmap);
+/* client-side image surface in the panel window format */
+cairo_t *create_cairo_for_panel_image(struct panel *p);
+void upload_panel_area(struct panel *p, cairo_surface_t *src,
+		       int x, int y, unsigned int w, unsigned int h);
+void free_panel_upload(struct panel *p);
+void panel_upload_completed(struct panel *p, unsigned long serial);
 
 void init_panel(struct panel *panel, struct config_format_tree *tree,
 		int monitor);
@@ -229,11 +341,19 @@ void reconfigure_panel(struct panel *panel, struct config_format_tree *tree,
 void reconfigure_panel_config(struct panel *panel);
 void reconfigure_widgets(struct panel *panel);
 void panel_main_loop(struct panel *panel);
+void panel_replay_trace(struct panel *panel);
 
 void recalculate_widgets_sizes(struct panel *panel);
+void schedule_redraw(struct panel *panel);
 int check_mbutton_condition(struct panel *panel, int mbutton, unsigned int condition);
 
 /* event dispatchers */
+void build_dispatch_tables(struct panel *p);
+void free_dispatch_tables(struct panel *p);
+void panel_track_window(struct widget *w, Window win);
+void panel_untrack_window(struct widget *w, Window win);
+void clear_tracked_windows(struct panel *p);
+
 void disp_button_press_release(struct panel *p, XButtonEvent *e);
 void disp_motion_notify(struct panel *p, XMotionEvent *e);
 void disp_property_notify(struct panel *p, XPropertyEvent *e);
@@ -0,0 +1,135 @@
+#include "netwm-icon.h"
+
+#ifdef NETWM_ICON_SIMD
+ #include <immintrin.h>
+#endif
+
+/*
+ * _NET_WM_ICON pixels are non-premultiplied ARGB in the low 32 bits of
+ * longs, cairo wants premultiplied ARGB32. Premultiplication is exact
+ * integer division by 255 with rounding: t = c*a + 128, (t + (t >> 8)) >> 8.
+ * On x86-64 icons are converted 4 (SSE2) or 8 (AVX2) pixels at a time, the
+ * kernel is selected at runtime.
+ */
+
+static inline uint32_t premultiply_pixel(uint32_t p)
+{
+	uint32_t a = p >> 24;
+	uint32_t rb = (p & 0xFF00FF) * a + 0x800080;
+	uint32_t g = (p & 0xFF00) * a + 0x8000;
+
+	rb = ((rb + ((rb >> 8) & 0xFF00FF)) >> 8) & 0xFF00FF;
+	g = ((g + ((g >> 8) & 0xFF00)) >> 8) & 0xFF00;
+	return (a << 24) | rb | g;
+}
+
+void netwm_to_argb32_scalar(uint32_t *dst, const long *src, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i)
+		dst[i] = premultiply_pixel((uint32_t)src[i]);
+}
+
+#ifdef NETWM_ICON_SIMD
+/* c * a / 255 for 16 bit lanes, alpha lanes are multiplied by 255 */
+#define PREMULTIPLY_EPI16(set1, add, srli, mullo, c, a)			\
+	srli(add(add(mullo(c, a), set1(128)),				\
+		 srli(add(mullo(c, a), set1(128)), 8)), 8)
+
+__attribute__((target("sse2")))
+static __m128i premultiply_sse2(__m128i px)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i alpha = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i lo = _mm_unpacklo_epi8(px, zero);
+	__m128i hi = _mm_unpackhi_epi8(px, zero);
+	__m128i alo, ahi;
+
+	alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+	ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+	alo = _mm_or_si128(_mm_and_si128(alo, rgb), alpha);
+	ahi = _mm_or_si128(_mm_and_si128(ahi, rgb), alpha);
+
+	lo = PREMULTIPLY_EPI16(_mm_set1_epi16, _mm_add_epi16, _mm_srli_epi16,
+			       _mm_mullo_epi16, lo, alo);
+	hi = PREMULTIPLY_EPI16(_mm_set1_epi16, _mm_add_epi16, _mm_srli_epi16,
+			       _mm_mullo_epi16, hi, ahi);
+	return _mm_packus_epi16(lo, hi);
+}
+
+__attribute__((target("sse2")))
+void netwm_to_argb32_sse2(uint32_t *dst, const long *src, size_t n)
+{
+	size_t i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		/* low halves of 4 longs */
+		__m128i l01 = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i l23 = _mm_loadu_si128((const __m128i*)&src[i+2]);
+		l01 = _mm_shuffle_epi32(l01, _MM_SHUFFLE(3,1,2,0));
+		l23 = _mm_shuffle_epi32(l23, _MM_SHUFFLE(3,1,2,0));
+		__m128i px = _mm_unpacklo_epi64(l01, l23);
+		_mm_storeu_si128((__m128i*)&dst[i], premultiply_sse2(px));
+	}
+	netwm_to_argb32_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void netwm_to_argb32_avx2(uint32_t *dst, const long *src, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i rgb = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1,
+					     0, -1, -1, -1, 0, -1, -1, -1);
+	const __m256i alpha = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0,
+					       255, 0, 0, 0, 255, 0, 0, 0);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		/* low halves of 8 longs, in order */
+		__m256i l0 = _mm256_loadu_si256((const __m256i*)&src[i]);
+		__m256i l1 = _mm256_loadu_si256((const __m256i*)&src[i+4]);
+		l0 = _mm256_shuffle_epi32(l0, _MM_SHUFFLE(3,1,2,0));
+		l1 = _mm256_shuffle_epi32(l1, _MM_SHUFFLE(3,1,2,0));
+		l0 = _mm256_permute4x64_epi64(l0, _MM_SHUFFLE(3,1,2,0));
+		l1 = _mm256_permute4x64_epi64(l1, _MM_SHUFFLE(3,1,2,0));
+		__m256i px = _mm256_permute2x128_si256(l0, l1, 0x20);
+
+		__m256i lo = _mm256_unpacklo_epi8(px, zero);
+		__m256i hi = _mm256_unpackhi_epi8(px, zero);
+		__m256i alo, ahi;
+
+		alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xFF), 0xFF);
+		ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xFF), 0xFF);
+		alo = _mm256_or_si256(_mm256_and_si256(alo, rgb), alpha);
+		ahi = _mm256_or_si256(_mm256_and_si256(ahi, rgb), alpha);
+
+		lo = PREMULTIPLY_EPI16(_mm256_set1_epi16, _mm256_add_epi16,
+				       _mm256_srli_epi16, _mm256_mullo_epi16,
+				       lo, alo);
+		hi = PREMULTIPLY_EPI16(_mm256_set1_epi16, _mm256_add_epi16,
+				       _mm256_srli_epi16, _mm256_mullo_epi16,
+				       hi, ahi);
+		/* unpack and pack are per 128 bit lane, the order is kept */
+		_mm256_storeu_si256((__m256i*)&dst[i],
+				    _mm256_packus_epi16(lo, hi));
+	}
+	netwm_to_argb32_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+void netwm_to_argb32(uint32_t *dst, const long *src, size_t n)
+{
+	static void (*kernel)(uint32_t*, const long*, size_t);
+
+	if (!kernel) {
+		kernel = netwm_to_argb32_scalar;
+#ifdef NETWM_ICON_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			kernel = netwm_to_argb32_avx2;
+		else
+			kernel = netwm_to_argb32_sse2;
+#endif
+	}
+	(*kernel)(dst, src, n);
+}
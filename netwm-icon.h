@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+ #define NETWM_ICON_SIMD
+#endif
+
+/* converts _NET_WM_ICON pixels to premultiplied cairo ARGB32 */
+void netwm_to_argb32(uint32_t *dst, const long *src, size_t n);
+
+/* kernels behind netwm_to_argb32, exposed for bench/bench-netwm.c */
+void netwm_to_argb32_scalar(uint32_t *dst, const long *src, size_t n);
+#ifdef NETWM_ICON_SIMD
+void netwm_to_argb32_sse2(uint32_t *dst, const long *src, size_t n);
+void netwm_to_argb32_avx2(uint32_t *dst, const long *src, size_t n);
+#endif
@@ -1,8 +1,17 @@
 #include <ctype.h>
 #include <stdio.h>
+#include <time.h>
 #include "gui.h"
 #include "settings.h"
 #include "widget-utils.h"
+#include "array.h"
+#include "trace.h"
+
+#ifdef HAVE_TIMERFD
+ #include <errno.h>
+ #include <unistd.h>
+ #include <sys/timerfd.h>
+#endif
 
 static int find_widget_in_stash(const char *interface, struct widget_stash *stash)
 {
@@ -111,13 +120,142 @@ static void free_panel_theme(struct panel_theme *theme)
   Panel
 **************************************************************************/
 
+/*
+ * Real transparency requires an ARGB window and the visual can't be changed
+ * later, so the composite render is available only if the panel window was
+ * created with a transparent theme while a composite manager was running
+ * (see recreate_panel_window). Pseudo and normal renders work on any window.
+ */
 static void select_render_interface(struct panel *p)
 {
-	/* TODO: composite manager detection and composite render */
-	if (p->theme.transparent)
-		p->render = &render_pseudo;
-	else
+	if (!p->theme.transparent)
 		p->render = &render_normal;
+	else if (p->depth == 32 &&
+		 x_composite_manager_running(&p->connection))
+		p->render = &render_composite;
+	else
+		p->render = &render_pseudo;
+}
+
+Pixmap create_panel_pixmap(struct panel *p)
+{
+	struct x_connection *c = &p->connection;
+	return XCreatePixmap(c->dpy, c->root, p->width, p->height, p->depth);
+}
+
+cairo_t *create_cairo_for_panel_pixmap(struct panel *p, Pixmap pixmap)
+{
+	cairo_surface_t *surface = cairo_xlib_surface_create(p->connection.dpy,
+							     pixmap, p->visual,
+							     p->width, p->height);
+	ENSURE(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS,
+	       "Error creating xlib/cairo surface");
+
+	cairo_t *cr = cairo_create(surface);
+	cairo_surface_destroy(surface);
+
+	ENSURE(cairo_status(cr) == CAIRO_STATUS_SUCCESS,
+	       "Error creating cairo context");
+	return cr;
+}
+
+/**************************************************************************
+  Client-side rendering
+**************************************************************************/
+
+/*
+ * With "client_side_rendering" renders draw to image surfaces only and
+ * upload damaged rectangles with XShmPutImage (XPutImage without MIT-SHM),
+ * the frame cost doesn't depend on the X server RENDER implementation.
+ */
+
+cairo_t *create_cairo_for_panel_image(struct panel *p)
+{
+	cairo_format_t format = (p->depth == 32) ? CAIRO_FORMAT_ARGB32 :
+						   CAIRO_FORMAT_RGB24;
+	cairo_surface_t *surface = cairo_image_surface_create(format, p->width,
+							      p->height);
+	ENSURE(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS,
+	       "Failed to create cairo image surface");
+
+	cairo_t *cr = cairo_create(surface);
+	cairo_surface_destroy(surface);
+	return cr;
+}
+
+void free_panel_upload(struct panel *p)
+{
+	Display *dpy = p->connection.dpy;
+
+	if (p->upload)
+		x_destroy_image(&p->connection, p->upload);
+	if (p->upload_gc)
+		XFreeGC(dpy, p->upload_gc);
+	p->upload = 0;
+	p->upload_gc = 0;
+	FREE_ARRAY(p->upload_pending);
+}
+
+static int upload_pending_overlaps(struct panel *p, int x, int y,
+				   unsigned int w, unsigned int h)
+{
+	size_t i;
+	for (i = 0; i < p->upload_pending_n; ++i) {
+		struct upload_span *s = &p->upload_pending[i];
+		if (x < s->x + s->width && x + (int)w > s->x &&
+		    y < s->y + s->height && y + (int)h > s->y)
+			return 1;
+	}
+	return 0;
+}
+
+/* ShmCompletion events come in request order */
+void panel_upload_completed(struct panel *p, unsigned long serial)
+{
+	size_t n = 0;
+
+	while (n < p->upload_pending_n &&
+	       p->upload_pending[n].serial <= serial)
+		n++;
+	if (!n)
+		return;
+	memmove(p->upload_pending, p->upload_pending + n,
+		(p->upload_pending_n - n) * sizeof(struct upload_span));
+	p->upload_pending_n -= n;
+}
+
+void upload_panel_area(struct panel *p, cairo_surface_t *src,
+		       int x, int y, unsigned int w, unsigned int h)
+{
+	struct x_connection *c = &p->connection;
+
+	if (p->upload && (p->upload->ximage->width != p->width ||
+			  p->upload->ximage->height != p->height))
+		free_panel_upload(p);
+	if (!p->upload) {
+		p->upload = x_create_image(c, p->visual, p->depth,
+					   p->width, p->height);
+		p->upload_gc = XCreateGC(c->dpy, p->bg, 0, 0);
+	}
+
+	/*
+	 * The server reads shared images asynchronously, until it sends
+	 * ShmCompletion for the upload. Writing to an area it may still be
+	 * reading requires a round trip, after which nothing is pending.
+	 */
+	if (upload_pending_overlaps(p, x, y, w, h)) {
+		PROFILE_ROUND_TRIP("upload_panel_area");
+		XSync(c->dpy, False);
+		CLEAR_ARRAY(p->upload_pending);
+	}
+
+	copy_surface_to_x_image(src, p->upload->ximage, x, y, w, h);
+	unsigned long serial = x_put_image(c, p->bg, p->upload_gc, p->upload,
+					   x, y, w, h);
+	if (serial) {
+		struct upload_span s = {serial, x, y, w, h};
+		ARRAY_APPEND(p->upload_pending, s);
+	}
 }
 
 static int one_monitor_on_top_of_another(const struct x_monitor *one,
@@ -238,21 +376,38 @@ static void create_window(struct panel *panel, int monitor)
 		monitor = 0;
 	get_position_and_strut(c, t, monitor, &x, &y, &w, &h, strut);
 	panel->monitor = monitor;
-
-	panel->bg = x_create_default_pixmap(c, w, h);
+	panel->x = x;
+	panel->y = y;
+	panel->width = w;
+	panel->height = h;
 
 	XSetWindowAttributes attrs;
+	unsigned long mask = CWBackPixmap | CWEventMask;
+
+	/* without a composite manager ARGB windows are opaque anyway, and
+	 * ARGB tray icons would lose their backgrounds */
+	if (t->transparent && x_find_argb_visual(c) == 0 &&
+	    x_composite_manager_running(c))
+	{
+		panel->visual = c->argb_visual;
+		panel->depth = 32;
+		attrs.colormap = c->argb_colormap;
+		attrs.border_pixel = 0;
+		mask |= CWColormap | CWBorderPixel;
+	} else {
+		panel->visual = c->default_visual;
+		panel->depth = c->default_depth;
+	}
+	panel->bg = create_panel_pixmap(panel);
+
 	attrs.background_pixmap = panel->bg;
 	attrs.event_mask = ExposureMask | StructureNotifyMask | ButtonPressMask |
 		ButtonReleaseMask | PointerMotionMask | EnterWindowMask |
 		LeaveWindowMask;
-	panel->win = x_create_default_window(c, x, y, w, h,
-					     CWBackPixmap | CWEventMask, &attrs);
-
-	panel->x = x;
-	panel->y = y;
-	panel->width = w;
-	panel->height = h;
+	panel->win = XCreateWindow(c->dpy, c->root, x, y, w, h, 0,
+				   panel->depth, InputOutput, panel->visual,
+				   mask, &attrs);
+	trace_panel_window(panel->win);
 
 	/* Xdnd awareness */
 	x_set_prop_atom(c, panel->win, c->atoms[XATOM_XDND_AWARE], 5);
@@ -311,6 +466,21 @@ static void create_window(struct panel *panel, int monitor)
 	XSetClassHint(c->dpy, panel->win, &ch);
 }
 
+static void rearm_tick_timer(struct panel *panel);
+
+static int create_widget(struct widget_interface *we, struct widget *w,
+			 struct config_format_entry *e,
+			 struct config_format_tree *tree)
+{
+	struct profile_scope ps;
+	int ret;
+
+	PROFILE_BEGIN(&ps, "create", we->theme_name);
+	ret = (*we->create_widget_private)(w, e, tree);
+	PROFILE_END(&ps);
+	return ret;
+}
+
 static void parse_panel_widgets(struct panel *panel, struct config_format_tree *tree)
 {
 	char *preferred_alternatives = get_preferred_alternatives();
@@ -335,17 +505,23 @@ static void parse_panel_widgets(struct panel *panel, struct config_format_tree *
 		w->interface = we;
 		w->panel = panel;
 		w->needs_expose = 0;
+		w->next_tick = 0;
+		w->surface = 0;
+		INIT_EMPTY_ARRAY(w->prop_interests);
 
-		if ((*we->create_widget_private)(w, e, tree) == 0) {
+		if (create_widget(we, w, e, tree) == 0) {
 			panel->widgets_n++;
 			w->no_separator = parse_bool("no_separator", e);
 			w->paint_replace = parse_bool("paint_replace", e);
 		} else {
+			free_widget_prop_interests(w);
 			XWARNING("Failed to create widget: \"%s\"", e->name);
 		}
 	}
 
 	reset_alternatives();
+	build_dispatch_tables(panel);
+	rearm_tick_timer(panel);
 }
 
 static void retheme_reconfigure_panel_widgets(struct widget_stash *stash,
@@ -375,6 +551,9 @@ static void retheme_reconfigure_panel_widgets(struct widget_stash *stash,
 		w->interface = we;
 		w->panel = panel;
 		w->needs_expose = 0;
+		w->next_tick = 0;
+		w->surface = 0;
+		INIT_EMPTY_ARRAY(w->prop_interests);
 
 		int stashwi = find_widget_in_stash(e->name, stash);
 		if (stashwi != -1 && we->retheme_reconfigure) {
@@ -392,21 +571,26 @@ static void retheme_reconfigure_panel_widgets(struct widget_stash *stash,
 				w->paint_replace = parse_bool("paint_replace", e);
 
 				continue;
-			} else
+			} else {
 				(*w->interface->destroy_widget_private)(w);
+				free_widget_prop_interests(w);
+			}
 		}
 
 		/* create new one if failed */
-		if ((*we->create_widget_private)(w, e, tree) == 0) {
+		if (create_widget(we, w, e, tree) == 0) {
 			panel->widgets_n++;
 			w->no_separator = parse_bool("no_separator", e);
 			w->paint_replace = parse_bool("paint_replace", e);
 		} else {
+			free_widget_prop_interests(w);
 			XWARNING("Failed to create widget: \"%s\"", e->name);
 		}
 	}
 
 	reset_alternatives();
+	build_dispatch_tables(panel);
+	rearm_tick_timer(panel);
 }
 
 void recalculate_widgets_sizes(struct panel *panel)
@@ -471,43 +655,204 @@ void recalculate_widgets_sizes(struct panel *panel)
 	panel->widgets[i].width = x2 - x;
 
 	/* request redraw */
+	panel->static_bg_valid = 0;
 	panel->needs_expose = 1;
+	schedule_redraw(panel);
 }
 
-static void expose_whole_panel(struct panel *panel)
+static void draw_widget(struct widget *w)
 {
-	Display *dpy = panel->connection.dpy;
+	struct profile_scope ps;
+	PROFILE_BEGIN(&ps, "draw", w->interface->theme_name);
+	(*w->interface->draw)(w);
+	PROFILE_END(&ps);
+}
 
-	int sepw = 0;
-	sepw += image_width(panel->theme.separator);
+/**************************************************************************
+  Static background layer
+**************************************************************************/
+
+static void free_static_background(struct panel *panel)
+{
+	if (panel->static_bg)
+		cairo_surface_destroy(panel->static_bg);
+	panel->static_bg = 0;
+	panel->static_bg_valid = 0;
+}
 
+/* same drawing order as a panel expose used to have: widget background,
+ * widget (if static), separator */
+static void build_static_background(struct panel *panel)
+{
+	cairo_t *panel_cr = panel->cr;
+	cairo_t *cr;
 	size_t i;
+
+	if (panel->static_bg &&
+	    (cairo_image_surface_get_width(panel->static_bg) != panel->width ||
+	     cairo_image_surface_get_height(panel->static_bg) != panel->height))
+		free_static_background(panel);
+	if (!panel->static_bg)
+		panel->static_bg = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							      panel->width,
+							      panel->height);
+
+	cr = cairo_create(panel->static_bg);
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
 	for (i = 0; i < panel->widgets_n; ++i) {
-		struct widget *wi = &panel->widgets[i];
-		int x = wi->x;
-		int w = wi->width;
-		if (!w) /* skip empty */
+		struct widget *w = &panel->widgets[i];
+		if (!w->width)
 			continue;
 
-		/* background */
-		pattern_image(panel->theme.background, panel->cr, x, 0, w, 0);
-
-		cairo_save(panel->cr);
-		if (wi->paint_replace)
-			cairo_set_operator(panel->cr, CAIRO_OPERATOR_SOURCE);
+		pattern_image(panel->theme.background, cr, w->x, 0, w->width, 0);
 
-		/* widget contents */
-		if (wi->interface->draw)
-			(*wi->interface->draw)(wi);
-		cairo_restore(panel->cr);
+		if (w->interface->static_draw && w->interface->draw) {
+			cairo_save(cr);
+			if (w->paint_replace)
+				cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+			panel->cr = cr;
+			draw_widget(w);
+			panel->cr = panel_cr;
+			cairo_restore(cr);
+		}
 
-		/* separator */
-		x += w;
 		if (panel->theme.separator && panel->widgets_n - 1 != i)
-			blit_image(panel->theme.separator, panel->cr, x, 0);
+			blit_image(panel->theme.separator, cr, w->x + w->width, 0);
+	}
+	cairo_destroy(cr);
+	panel->static_bg_valid = 1;
+}
 
-		/* widget was drawn, clear "needs_expose" flag */
-		wi->needs_expose = 0;
+static void ensure_static_background(struct panel *panel)
+{
+	if (!panel->static_bg_valid || !panel->static_bg ||
+	    cairo_image_surface_get_width(panel->static_bg) != panel->width ||
+	    cairo_image_surface_get_height(panel->static_bg) != panel->height)
+		build_static_background(panel);
+}
+
+/* copies a part of static background layer, "cr" is in panel coordinates */
+static void blit_static_background(struct panel *panel, cairo_t *cr,
+				   int x, int width)
+{
+	cairo_save(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, panel->static_bg, 0, 0);
+	cairo_rectangle(cr, x, 0, width, panel->height);
+	cairo_fill(cr);
+	cairo_restore(cr);
+}
+
+/**************************************************************************
+  Retained widget surfaces
+**************************************************************************/
+
+static void free_widget_surface(struct widget *w)
+{
+	if (w->surface)
+		cairo_surface_destroy(w->surface);
+	w->surface = 0;
+	w->surface_valid = 0;
+}
+
+static void invalidate_widget_surfaces(struct panel *panel)
+{
+	size_t i;
+	for (i = 0; i < panel->widgets_n; ++i)
+		panel->widgets[i].surface_valid = 0;
+}
+
+/*
+ * Widget draws into its own surface, the panel context is swapped for the
+ * duration of the draw call and translated, so that widgets keep using
+ * panel coordinates.
+ */
+static void render_widget_surface(struct panel *panel, struct widget *w)
+{
+	cairo_t *panel_cr = panel->cr;
+	cairo_t *cr;
+
+	if (w->surface &&
+	    (cairo_image_surface_get_width(w->surface) != w->width ||
+	     cairo_image_surface_get_height(w->surface) != panel->height))
+		free_widget_surface(w);
+
+	if (!w->surface)
+		w->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							w->width,
+							panel->height);
+
+	cr = cairo_create(w->surface);
+	cairo_translate(cr, -w->x, 0);
+
+	/* starts from the background slice */
+	blit_static_background(panel, cr, w->x, w->width);
+	if (w->paint_replace)
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+	if (w->interface->draw) {
+		panel->cr = cr;
+		draw_widget(w);
+		panel->cr = panel_cr;
+	}
+	cairo_destroy(cr);
+
+	w->surface_x = w->x;
+	w->surface_valid = 1;
+}
+
+/* puts widget contents to the panel context, redraws them if necessary */
+static void composite_widget(struct panel *panel, struct widget *w)
+{
+	cairo_t *cr = panel->cr;
+
+	ensure_static_background(panel);
+	if (w->interface->static_draw) {
+		blit_static_background(panel, cr, w->x, w->width);
+		w->needs_expose = 0;
+		return;
+	}
+
+	if (w->needs_expose || w->x != w->surface_x || !w->surface ||
+	    cairo_image_surface_get_width(w->surface) != w->width ||
+	    cairo_image_surface_get_height(w->surface) != panel->height)
+		w->surface_valid = 0;
+	if (!w->surface_valid)
+		render_widget_surface(panel, w);
+
+	cairo_save(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, w->surface, w->x, 0);
+	cairo_rectangle(cr, w->x, 0, w->width, panel->height);
+	cairo_fill(cr);
+	cairo_restore(cr);
+
+	w->needs_expose = 0;
+}
+
+static void expose_whole_panel(struct panel *panel)
+{
+	Display *dpy = panel->connection.dpy;
+	struct profile_scope ps;
+	PROFILE_BEGIN(&ps, "expose", "whole panel");
+
+	/* background, separators and static widgets */
+	ensure_static_background(panel);
+	blit_static_background(panel, panel->cr, 0, panel->width);
+
+	size_t i;
+	for (i = 0; i < panel->widgets_n; ++i) {
+		struct widget *wi = &panel->widgets[i];
+		if (!wi->width || wi->interface->static_draw) {
+			wi->needs_expose = 0;
+			continue;
+		}
+
+		/* widget contents, background included */
+		composite_widget(panel, wi);
 	}
 
 	(*panel->render->blit)(panel, 0, 0, panel->width, panel->height);
@@ -517,43 +862,293 @@ static void expose_whole_panel(struct panel *panel)
 	/* after exposing panel actions, for those who need panel background
 	 * (e.g. systray icons)
 	 */
-	for (i = 0; i < panel->widgets_n; ++i) {
-		struct widget *wi = &panel->widgets[i];
-		if (wi->interface->panel_exposed)
-			(*wi->interface->panel_exposed)(wi);
+	struct widget_list *l = &panel->handlers[DISP_PANEL_EXPOSED];
+	for (i = 0; i < l->widgets_n; ++i) {
+		struct widget *wi = l->widgets[i];
+		(*wi->interface->panel_exposed)(wi);
 	}
 	XFlush(dpy);
+	PROFILE_END(&ps);
+}
+
+/*
+ * Damaged area of the panel is a set of x spans (widgets take the whole panel
+ * height). Spans of adjacent widgets are merged, as well as spans separated
+ * only by a separator: separators live in the static background layer, the
+ * gap is refreshed from there and one blit replaces two.
+ */
+struct damage_span {
+	int x;
+	int width;
+};
+
+static void add_damage(struct panel *panel, struct damage_span *spans,
+		       size_t *spans_n, int x, int width)
+{
+	struct damage_span *last = (*spans_n) ? &spans[*spans_n - 1] : 0;
+	int sepw = image_width(panel->theme.separator);
+
+	if (!width)
+		return;
+
+	/* widgets are sorted by x */
+	if (last && x <= last->x + last->width + sepw) {
+		int gap = x - (last->x + last->width);
+		int end = MAXINT(last->x + last->width, x + width);
+		if (gap > 0)
+			blit_static_background(panel, panel->cr,
+					       last->x + last->width, gap);
+		last->width = end - last->x;
+		return;
+	}
+
+	spans[*spans_n].x = x;
+	spans[*spans_n].width = width;
+	(*spans_n)++;
 }
 
 static void expose_panel(struct panel *panel)
 {
 	Display *dpy = panel->connection.dpy;
+	struct damage_span spans[PANEL_MAX_WIDGETS];
+	size_t spans_n = 0;
+	struct profile_scope ps;
 
 	if (panel->needs_expose) {
 		expose_whole_panel(panel);
 		return;
 	}
 
+	PROFILE_BEGIN(&ps, "expose", "widgets");
+
 	size_t i;
 	for (i = 0; i < panel->widgets_n; ++i) {
 		struct widget *w = &panel->widgets[i];
 		if (!w->needs_expose)
 			continue;
+		if (!w->width) {
+			w->needs_expose = 0;
+			continue;
+		}
 
-		pattern_image(panel->theme.background, panel->cr,
-				w->x, 0, w->width, 0);
-		cairo_save(panel->cr);
-		if (w->paint_replace)
-			cairo_set_operator(panel->cr, CAIRO_OPERATOR_SOURCE);
-		if (w->interface->draw)
-			(*w->interface->draw)(w);
-		cairo_restore(panel->cr);
-
-		(*panel->render->blit)(panel, w->x, 0,
-				       w->width, panel->height);
-		w->needs_expose = 0;
+		/* nothing outside of the widget area is touched */
+		composite_widget(panel, w);
+		add_damage(panel, spans, &spans_n, w->x, w->width);
 	}
+
+	for (i = 0; i < spans_n; ++i)
+		(*panel->render->blit)(panel, spans[i].x, 0,
+				       spans[i].width, panel->height);
 	XFlush(dpy);
+	PROFILE_END(&ps);
+}
+
+/**************************************************************************
+  Redraw scheduler
+**************************************************************************/
+
+static int panel_needs_redraw(struct panel *panel)
+{
+	size_t i;
+	if (panel->needs_expose)
+		return 1;
+	for (i = 0; i < panel->widgets_n; ++i) {
+		if (panel->widgets[i].needs_expose)
+			return 1;
+	}
+	return 0;
+}
+
+static gboolean redraw_timeout(gpointer data)
+{
+	struct panel *panel = data;
+
+	panel->redraw_source = 0;
+	panel->last_redraw = g_get_monotonic_time();
+	expose_panel(panel);
+	return 0;
+}
+
+/* Requests a redraw of everything marked with "needs_expose". Painting is
+ * deferred to the next frame, so that any number of requests within one
+ * frame interval results in a single redraw.
+ */
+void schedule_redraw(struct panel *panel)
+{
+	if (panel->redraw_source)
+		return;
+
+	gint64 since_last = (g_get_monotonic_time() - panel->last_redraw) / 1000;
+	if (since_last < 0 || since_last >= panel->frame_interval)
+		panel->redraw_source = g_idle_add(redraw_timeout, panel);
+	else
+		panel->redraw_source = g_timeout_add(
+				panel->frame_interval - since_last,
+				redraw_timeout, panel);
+}
+
+static void cancel_redraw(struct panel *panel)
+{
+	if (panel->redraw_source) {
+		g_source_remove(panel->redraw_source);
+		panel->redraw_source = 0;
+	}
+}
+
+/**************************************************************************
+  Widget timers
+**************************************************************************/
+
+/*
+ * Widgets compute their delays from the wall clock (e.g. the next minute),
+ * so deadlines are wall clock times as well. With timerfd the timer is an
+ * absolute CLOCK_REALTIME one, it fires at the deadline even if the machine
+ * was suspended in between, and TFD_TIMER_CANCEL_ON_SET wakes us up when the
+ * clock is stepped (NTP, date), then all ticks are due, widgets reschedule
+ * from the new time. Without timerfd a relative timeout is used, which may
+ * be late after a suspend or a clock step.
+ */
+
+static gboolean tick_timeout(gpointer data);
+
+#ifdef HAVE_TIMERFD
+static gboolean tick_fd_ready(GIOChannel *source, GIOCondition condition,
+			      gpointer data);
+
+static void arm_tick_fd(struct panel *panel, gint64 deadline)
+{
+	struct itimerspec its;
+
+	if (!panel->tick_source) {
+		GIOChannel *ch;
+
+		panel->tick_fd = timerfd_create(CLOCK_REALTIME,
+						TFD_NONBLOCK | TFD_CLOEXEC);
+		if (panel->tick_fd < 0)
+			XDIE("Failed to create timerfd: %s", strerror(errno));
+		ch = g_io_channel_unix_new(panel->tick_fd);
+		panel->tick_source = g_io_add_watch(ch, G_IO_IN,
+						    tick_fd_ready, panel);
+		g_io_channel_unref(ch);
+	}
+
+	/* zero disarms the timer */
+	CLEAR_STRUCT(&its);
+	its.it_value.tv_sec = deadline / 1000000;
+	its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	timerfd_settime(panel->tick_fd,
+			TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, 0);
+}
+
+static gboolean tick_fd_ready(GIOChannel *source, GIOCondition condition,
+			      gpointer data)
+{
+	struct panel *panel = data;
+	uint64_t expirations;
+
+	if (read(panel->tick_fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious wake up, e.g. the timer was re-armed meanwhile */
+		if (errno != ECANCELED)
+			return 1;
+		panel->tick_clock_set = 1;
+	}
+	tick_timeout(panel);
+	return 1;
+}
+#endif
+
+/* Arms a single timer at the earliest widget deadline. */
+static void rearm_tick_timer(struct panel *panel)
+{
+	struct widget_list *l = &panel->handlers[DISP_CLOCK_TICK];
+	gint64 deadline = 0;
+	size_t i;
+
+	for (i = 0; i < l->widgets_n; ++i) {
+		gint64 t = l->widgets[i]->next_tick;
+		if (t && (!deadline || t < deadline))
+			deadline = t;
+	}
+
+	if (panel->tick_source && deadline == panel->tick_deadline)
+		return;
+	panel->tick_deadline = deadline;
+
+#ifdef HAVE_TIMERFD
+	arm_tick_fd(panel, deadline);
+#else
+	if (panel->tick_source) {
+		g_source_remove(panel->tick_source);
+		panel->tick_source = 0;
+	}
+	if (!deadline)
+		return;
+
+	gint64 delay = deadline - g_get_real_time();
+	if (delay < 0)
+		delay = 0;
+	/* round up, waking up too early means one more wake up */
+	panel->tick_source = g_timeout_add((delay + 999) / 1000,
+					   tick_timeout, panel);
+#endif
+}
+
+static void cancel_tick_timer(struct panel *panel)
+{
+	if (panel->tick_source) {
+		g_source_remove(panel->tick_source);
+		panel->tick_source = 0;
+#ifdef HAVE_TIMERFD
+		close(panel->tick_fd);
+#endif
+	}
+	panel->tick_deadline = 0;
+}
+
+static gboolean tick_timeout(gpointer data)
+{
+	struct panel *panel = data;
+	struct widget_list *l = &panel->handlers[DISP_CLOCK_TICK];
+	gint64 now = g_get_real_time();
+	int clock_set = panel->tick_clock_set;
+	size_t i;
+
+#ifndef HAVE_TIMERFD
+	panel->tick_source = 0;
+#endif
+	/* the timer has fired, it has to be armed again */
+	panel->tick_deadline = 0;
+	panel->tick_clock_set = 0;
+	for (i = 0; i < l->widgets_n; ++i) {
+		struct widget *w = l->widgets[i];
+		if (w->next_tick && (clock_set || w->next_tick <= now)) {
+			w->next_tick = 0;
+			struct profile_scope ps;
+			PROFILE_BEGIN(&ps, "clock_tick", w->interface->theme_name);
+			(*w->interface->clock_tick)(w);
+			PROFILE_END(&ps);
+		}
+	}
+
+	if (panel_needs_redraw(panel))
+		schedule_redraw(panel);
+	rearm_tick_timer(panel);
+	return 0;
+}
+
+/* Schedules a "clock_tick" call in "msec" milliseconds, replacing the
+ * previously scheduled one. Widgets are not woken up otherwise.
+ */
+void widget_schedule_tick(struct widget *w, unsigned int msec)
+{
+	w->next_tick = g_get_real_time() + (gint64)msec * 1000;
+	rearm_tick_timer(w->panel);
+}
+
+void widget_cancel_tick(struct widget *w)
+{
+	w->next_tick = 0;
+	rearm_tick_timer(w->panel);
 }
 
 void init_panel(struct panel *panel, struct config_format_tree *tree,
@@ -567,14 +1162,17 @@ void init_panel(struct panel *panel, struct config_format_tree *tree,
 	/* parse panel theme */
 	if (load_panel_theme(&panel->theme, tree))
 		XDIE("Failed to load theme format file");
+	panel->tree = tree;
 
 	reconfigure_panel_config(panel);
 
-	select_render_interface(panel);
 	struct x_connection *c = &panel->connection;
 
 	/* create window */
 	create_window(panel, monitor);
+	select_render_interface(panel);
+	panel->client_side_rendering = parse_bool("client_side_rendering",
+						  &g_settings.root);
 
 	/* render private */
 	if (panel->render->create_private)
@@ -604,38 +1202,71 @@ void free_panel(struct panel *panel)
 {
 	size_t i;
 
+	cancel_redraw(panel);
+	cancel_tick_timer(panel);
 	if (panel->render->free_private)
 		(*panel->render->free_private)(panel);
 
 	for (i = 0; i < panel->widgets_n; ++i) {
 		struct widget *w = &panel->widgets[i];
 		(*w->interface->destroy_widget_private)(w);
+		free_widget_prop_interests(w);
+		free_widget_surface(w);
 	}
 	panel->widgets_n = 0;
+	free_static_background(panel);
+	free_dispatch_tables(panel);
+	clear_tracked_windows(panel);
 
+	clean_text_cache();
 	g_object_unref(panel->layout);
 	cairo_destroy(panel->cr);
+	free_panel_upload(panel);
 	XDestroyWindow(panel->connection.dpy, panel->win);
 	XFreePixmap(panel->connection.dpy, panel->bg);
 	free_panel_theme(&panel->theme);
 	x_disconnect(&panel->connection);
 }
 
+static void destroy_stashed_widgets(struct widget_stash *stash)
+{
+	size_t i;
+	for (i = 0; i < stash->widgets_n; ++i) {
+		struct widget *w = &stash->widgets[i];
+		(*w->interface->destroy_widget_private)(w);
+		free_widget_prop_interests(w);
+	}
+	stash->widgets_n = 0;
+}
+
 void reconfigure_free_panel(struct panel *panel, struct widget_stash *stash)
 {
+	size_t i;
+
 	/* free stuff */
+	cancel_redraw(panel);
+	cancel_tick_timer(panel);
 	if (panel->render->free_private)
 		(*panel->render->free_private)(panel);
 
+	/* surfaces are theme dependent */
+	for (i = 0; i < panel->widgets_n; ++i)
+		free_widget_surface(&panel->widgets[i]);
+	free_static_background(panel);
+
 	stash->widgets = xmalloc(sizeof(struct widget) * panel->widgets_n);
 	stash->widgets_n = panel->widgets_n;
 	memcpy(stash->widgets, panel->widgets,
 	       sizeof(struct widget) * panel->widgets_n);
 
 	panel->widgets_n = 0;
+	free_dispatch_tables(panel);
+	clear_tracked_windows(panel);
 
+	clean_text_cache();
 	g_object_unref(panel->layout);
 	cairo_destroy(panel->cr);
+	free_panel_upload(panel);
 	free_panel_theme(&panel->theme);
 }
 
@@ -645,30 +1276,41 @@ void reconfigure_panel(struct panel *panel, struct config_format_tree *tree,
 	/* reload theme */
 	if (load_panel_theme(&panel->theme, tree))
 		XDIE("Failed to load theme format file");
+	panel->tree = tree;
 
 	/* reparse config values */
 	reconfigure_panel_config(panel);
 
-	/* check render interface */
-	select_render_interface(panel);
-
 	/* move panel */
 	struct x_connection *c = &panel->connection;
 	struct panel_theme *t = &panel->theme;
 
 	int x,y,w,h;
 	long strut[12] = {0};
-	if (monitor >= c->monitors_n)
-		monitor = 0;
-	get_position_and_strut(c, t, monitor, &x, &y, &w, &h, strut);
-	panel->monitor = monitor;
-	panel->x = x;
-	panel->y = y;
-	panel->width = w;
-	panel->height = h;
+	int created = 0;
+
+	if (panel->win == None) {
+		/* destroyed by recreate_panel_window */
+		create_window(panel, monitor);
+		created = 1;
+	} else {
+		if (monitor >= c->monitors_n)
+			monitor = 0;
+		get_position_and_strut(c, t, monitor, &x, &y, &w, &h, strut);
+		panel->monitor = monitor;
+		panel->x = x;
+		panel->y = y;
+		panel->width = w;
+		panel->height = h;
+
+		XFreePixmap(panel->connection.dpy, panel->bg);
+		panel->bg = create_panel_pixmap(panel);
+	}
 
-	XFreePixmap(panel->connection.dpy, panel->bg);
-	panel->bg = x_create_default_pixmap(c, w, h);
+	/* check render interface */
+	select_render_interface(panel);
+	panel->client_side_rendering = parse_bool("client_side_rendering",
+						  &g_settings.root);
 
 	/* render private */
 	if (panel->render->create_private)
@@ -682,14 +1324,20 @@ void reconfigure_panel(struct panel *panel, struct config_format_tree *tree,
 
 	/* reparse panel widgets */
 	retheme_reconfigure_panel_widgets(stash, panel, tree);
-	size_t i;
-	for (i = 0; i < stash->widgets_n; ++i) {
-		struct widget *w = &stash->widgets[i];
-		(*w->interface->destroy_widget_private)(w);
-	}
+	destroy_stashed_widgets(stash);
 	xfree(stash->widgets);
 	recalculate_widgets_sizes(panel);
 
+	if (created) {
+		expose_panel(panel);
+		XMapWindow(c->dpy, panel->win);
+		XFlush(c->dpy);
+		x_send_netwm_message(c, panel->win,
+				     c->atoms[XATOM_NET_WM_DESKTOP],
+				     0xFFFFFFFF, 0, 0, 0, 0);
+		return;
+	}
+
 	/* all ok, update window */
 	XSetWindowBackgroundPixmap(c->dpy, panel->win, panel->bg);
 	XFlush(c->dpy);
@@ -720,6 +1368,13 @@ void reconfigure_panel_config(struct panel *panel)
 	panel->mbutton[0] = parse_mbutton_state("mbutton1", MBUTTON_1_DEFAULT);
 	panel->mbutton[1] = parse_mbutton_state("mbutton2", MBUTTON_2_DEFAULT);
 	panel->mbutton[2] = parse_mbutton_state("mbutton3", MBUTTON_3_DEFAULT);
+
+	int frame_rate = parse_int("frame_rate", &g_settings.root, 60);
+	if (frame_rate < 1)
+		frame_rate = 1;
+	if (frame_rate > 1000)
+		frame_rate = 1000;
+	panel->frame_interval = 1000 / frame_rate;
 }
 
 void reconfigure_widgets(struct panel *panel)
@@ -730,6 +1385,7 @@ void reconfigure_widgets(struct panel *panel)
 		if (w->interface->reconfigure)
 			(*w->interface->reconfigure)(w);
 	}
+	invalidate_widget_surfaces(panel);
 	recalculate_widgets_sizes(panel);
 }
 
@@ -756,6 +1412,68 @@ static void panel_property_notify(struct panel *p, XPropertyEvent *e)
 	}
 }
 
+/*
+ * A composite manager started after a transparent panel was created with the
+ * default visual. The visual can't be changed, so the window is rebuilt on
+ * the ARGB visual through the reconfiguration path. Widgets are created from
+ * scratch: the systray embeds icons into the old window and advertises its
+ * visual, the taskbar defines cursors on it.
+ */
+static void recreate_panel_window(struct panel *p)
+{
+	struct x_connection *c = &p->connection;
+	struct widget_stash ws;
+
+	reconfigure_free_panel(p, &ws);
+	destroy_stashed_widgets(&ws);
+
+	/* pointer state refers to the destroyed widgets */
+	p->under_mouse = 0;
+	p->last_click_widget = 0;
+	p->dnd.taken_on = 0;
+
+	XDestroyWindow(c->dpy, p->win);
+	XFreePixmap(c->dpy, p->bg);
+	p->win = None;
+	p->bg = None;
+
+	reconfigure_panel(p, p->tree, &ws, p->monitor);
+}
+
+/* composite manager started or exited, switch between pseudo and real
+ * transparency, the window is recreated only if it lacks an ARGB visual */
+static void panel_composite_manager_changed(struct panel *p)
+{
+	struct x_connection *c = &p->connection;
+	struct render_interface *old = p->render;
+
+	if (p->theme.transparent && p->depth != 32 &&
+	    x_composite_manager_running(c) && x_find_argb_visual(c) == 0)
+	{
+		recreate_panel_window(p);
+		return;
+	}
+
+	select_render_interface(p);
+	if (p->render == old)
+		return;
+
+	if (old->free_private)
+		(*old->free_private)(p);
+	cairo_destroy(p->cr);
+
+	XFreePixmap(c->dpy, p->bg);
+	p->bg = create_panel_pixmap(p);
+	XSetWindowBackgroundPixmap(c->dpy, p->win, p->bg);
+
+	if (p->render->create_private)
+		(*p->render->create_private)(p);
+	(*p->render->create_dc)(p);
+
+	p->needs_expose = 1;
+	schedule_redraw(p);
+}
+
 static void panel_configure_notify(struct panel *p, XConfigureEvent *e)
 {
 	struct x_connection *c = &p->connection;
@@ -810,120 +1528,306 @@ static void panel_expose(struct panel *p, XExposeEvent *e)
 		(*p->render->expose)(p);
 }
 
-static int process_events(struct panel *p)
+/**************************************************************************
+  Event processing
+**************************************************************************/
+
+/* Events are drained from Xlib in batches of at most that size, so that
+ * redundant ones can be coalesced before dispatching. */
+#define EVENTS_BATCH_SIZE 256
+
+static XEvent events_batch[EVENTS_BATCH_SIZE];
+
+/*
+ * Returns non-zero if the event "i" can be dropped, because a later event in
+ * the batch carries the same (or more recent) information. Handlers re-read
+ * the actual window state anyway, so handling only the latest instance
+ * gives the same result.
+ */
+static int is_event_superseded(XEvent *events, int events_n, int i)
 {
-	Display *dpy = p->connection.dpy;
-	int events_processed = 0;
+	XEvent *e = &events[i];
+	int j;
+
+	switch (e->type) {
+	case MotionNotify:
+		/* only runs, pointer position between other events matters
+		 * for enter/leave and dnd logic */
+		return i + 1 < events_n &&
+			events[i+1].type == MotionNotify &&
+			events[i+1].xmotion.window == e->xmotion.window;
+
+	case PropertyNotify:
+		for (j = i + 1; j < events_n; ++j) {
+			XPropertyEvent *later = &events[j].xproperty;
+			if (later->type == PropertyNotify &&
+			    later->window == e->xproperty.window &&
+			    later->atom == e->xproperty.atom)
+				return 1;
+		}
+		return 0;
 
-	while (XPending(dpy)) {
-		XEvent e;
+	case ConfigureNotify:
+		for (j = i + 1; j < events_n; ++j) {
+			XConfigureEvent *later = &events[j].xconfigure;
+			if (later->type == ConfigureNotify &&
+			    later->event == e->xconfigure.event &&
+			    later->window == e->xconfigure.window)
+				return 1;
+		}
+		return 0;
 
-		events_processed++;
-		XNextEvent(dpy, &e);
+	default:
+		break;
+	}
+	return 0;
+}
 
-		switch (e.type) {
+static const char *event_names[LASTEvent] = {
+	[KeyPress] = "KeyPress",
+	[KeyRelease] = "KeyRelease",
+	[ButtonPress] = "ButtonPress",
+	[ButtonRelease] = "ButtonRelease",
+	[MotionNotify] = "MotionNotify",
+	[EnterNotify] = "EnterNotify",
+	[LeaveNotify] = "LeaveNotify",
+	[FocusIn] = "FocusIn",
+	[FocusOut] = "FocusOut",
+	[KeymapNotify] = "KeymapNotify",
+	[Expose] = "Expose",
+	[GraphicsExpose] = "GraphicsExpose",
+	[NoExpose] = "NoExpose",
+	[VisibilityNotify] = "VisibilityNotify",
+	[CreateNotify] = "CreateNotify",
+	[DestroyNotify] = "DestroyNotify",
+	[UnmapNotify] = "UnmapNotify",
+	[MapNotify] = "MapNotify",
+	[MapRequest] = "MapRequest",
+	[ReparentNotify] = "ReparentNotify",
+	[ConfigureNotify] = "ConfigureNotify",
+	[ConfigureRequest] = "ConfigureRequest",
+	[GravityNotify] = "GravityNotify",
+	[ResizeRequest] = "ResizeRequest",
+	[CirculateNotify] = "CirculateNotify",
+	[CirculateRequest] = "CirculateRequest",
+	[PropertyNotify] = "PropertyNotify",
+	[SelectionClear] = "SelectionClear",
+	[SelectionRequest] = "SelectionRequest",
+	[SelectionNotify] = "SelectionNotify",
+	[ColormapNotify] = "ColormapNotify",
+	[ClientMessage] = "ClientMessage",
+	[MappingNotify] = "MappingNotify",
+	[GenericEvent] = "GenericEvent"
+};
+
+static const char *event_name(int type)
+{
+	if (type >= 0 && type < LASTEvent && event_names[type])
+		return event_names[type];
+	return "extension";
+}
 
-		case NoExpose:
-		case MapNotify:
-		case UnmapNotify:
-		case VisibilityNotify:
-		case ReparentNotify:
-		case SelectionClear:
-			/* skip? */
+static void dispatch_event(struct panel *p, XEvent *e)
+{
+	struct profile_scope ps;
+	unsigned long serial;
+	PROFILE_BEGIN(&ps, "event", event_name(e->type));
+
+	switch (e->type) {
+
+	case NoExpose:
+	case MapNotify:
+	case UnmapNotify:
+	case VisibilityNotify:
+	case ReparentNotify:
+	case SelectionClear:
+		/* skip? */
+		break;
+
+	case Expose:
+		panel_expose(p, &e->xexpose);
+		break;
+
+	case ButtonRelease:
+	case ButtonPress:
+		panel_button_press_release(p, &e->xbutton);
+		disp_button_press_release(p, &e->xbutton);
+		break;
+
+	case MotionNotify:
+		disp_motion_notify(p, &e->xmotion);
+		break;
+
+	case EnterNotify:
+	case LeaveNotify:
+		disp_enter_leave_notify(p, &e->xcrossing);
+		break;
+
+	case PropertyNotify:
+		panel_property_notify(p, &e->xproperty);
+		disp_property_notify(p, &e->xproperty);
+		break;
+
+	case ClientMessage:
+		disp_client_msg(p, &e->xclient);
+		break;
+
+	case ConfigureNotify:
+		panel_configure_notify(p, &e->xconfigure);
+		disp_configure(p, &e->xconfigure);
+		break;
+
+	case DestroyNotify:
+		disp_win_destroy(p, &e->xdestroywindow);
+		break;
+
+	default:
+		if (x_is_composite_manager_event(&p->connection, e)) {
+			panel_composite_manager_changed(p);
 			break;
-
-		case Expose:
-			panel_expose(p, &e.xexpose);
+		}
+		serial = x_shm_completion_serial(&p->connection, e);
+		if (serial) {
+			/* recorded serials mean nothing for this connection */
+			if (trace_mode != TRACE_REPLAY)
+				panel_upload_completed(p, serial);
 			break;
+		}
+		/* Unknown XEvent(s) should be eaten, not logged
+		 *  
+		XWARNING("Unknown XEvent (type: %d, win: %d)",
+			 e->type, e->xany.window);
+		*/
+		break;
+	}
 
-		case ButtonRelease:
-		case ButtonPress:
-			panel_button_press_release(p, &e.xbutton);
-			disp_button_press_release(p, &e.xbutton);
-			break;
+	PROFILE_END(&ps);
+}
 
-		case MotionNotify:
-			disp_motion_notify(p, &e.xmotion);
-			break;
+static int process_events(struct panel *p)
+{
+	Display *dpy = p->connection.dpy;
+	XEvent *events = events_batch;
+	int events_n = 0;
+	int i;
 
-		case EnterNotify:
-		case LeaveNotify:
-			disp_enter_leave_notify(p, &e.xcrossing);
-			break;
+	if (trace_mode == TRACE_REPLAY) {
+		events_n = trace_read_events(dpy, events, EVENTS_BATCH_SIZE);
+	} else {
+		while (events_n < EVENTS_BATCH_SIZE && XPending(dpy))
+			XNextEvent(dpy, &events[events_n++]);
+		if (events_n && trace_mode == TRACE_RECORD)
+			trace_write_events(events, events_n);
+	}
 
-		case PropertyNotify:
-			panel_property_notify(p, &e.xproperty);
-			disp_property_notify(p, &e.xproperty);
-			break;
+	for (i = 0; i < events_n; ++i) {
+		if (is_event_superseded(events, events_n, i))
+			continue;
+		dispatch_event(p, &events[i]);
+	}
 
-		case ClientMessage:
-			disp_client_msg(p, &e.xclient);
-			break;
+	if (events_n && panel_needs_redraw(p))
+		schedule_redraw(p);
+	return events_n;
+}
 
-		case ConfigureNotify:
-			panel_configure_notify(p, &e.xconfigure);
-			disp_configure(p, &e.xconfigure);
-			break;
+/* X events source, unlike plain fd watch, it's aware of events queued by Xlib
+ * during replies reading, so there is no need to poll for them */
+struct x_source {
+	GSource source;
+	GPollFD poll_fd;
+	struct panel *panel;
+};
 
-		case DestroyNotify:
-			disp_win_destroy(p, &e.xdestroywindow);
-			break;
+static gboolean x_source_prepare(GSource *source, gint *timeout)
+{
+	struct x_source *xs = (struct x_source*)source;
+	Display *dpy = xs->panel->connection.dpy;
 
-		default:
-			/* Unknown XEvent(s) should be eaten, not logged
-			 *  
-			XWARNING("Unknown XEvent (type: %d, win: %d)",
-				 e.type, e.xany.window);
-			*/
-			break;
-		}
-	}
-	if (events_processed)
-		expose_panel(p);
-	return events_processed;
+	*timeout = -1;
+	XFlush(dpy);
+	return XEventsQueued(dpy, QueuedAlready) > 0;
 }
 
-static gboolean panel_second_timeout(gpointer data)
+static gboolean x_source_check(GSource *source)
 {
-	struct panel *p = data;
-	size_t i;
-	struct widget *w;
-	for (i = 0; i < p->widgets_n; ++i) {
-		w = &p->widgets[i];
-		if (w->interface->clock_tick)
-			(*w->interface->clock_tick)(w);
-	}
-	expose_panel(p);
-	/* just in case, actually it helps a lot */
-	process_events(p);
-	return 1;
+	struct x_source *xs = (struct x_source*)source;
+	Display *dpy = xs->panel->connection.dpy;
+
+	if (xs->poll_fd.revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+		return 1;
+	return XEventsQueued(dpy, QueuedAlready) > 0;
 }
 
-static gboolean panel_x_in(GIOChannel *gio, GIOCondition condition, gpointer data)
+static gboolean x_source_dispatch(GSource *source, GSourceFunc callback,
+				  gpointer data)
 {
 	/* TODO: be aware of connection drop */
-	/* ENSURE(condition == G_IO_IN, "Input condition failed"); */
-	struct panel *p = data;
+	struct x_source *xs = (struct x_source*)source;
 
 	/* we do here more greedy processing */
-	while (process_events(p))
+	while (process_events(xs->panel))
 		;
 
 	return 1;
 }
 
+static GSourceFuncs x_source_funcs = {
+	.prepare = x_source_prepare,
+	.check = x_source_check,
+	.dispatch = x_source_dispatch
+};
+
 void panel_main_loop(struct panel *panel)
 {
-	int fd = ConnectionNumber(panel->connection.dpy);
 	panel->loop = g_main_loop_new(0, 0);
 
-	GIOChannel *x = g_io_channel_unix_new(fd);
-	g_io_add_watch(x, G_IO_IN | G_IO_HUP, panel_x_in, panel);
-	g_io_channel_unref(x);
-
-	g_timeout_add(1000, panel_second_timeout, panel);
+	GSource *source = g_source_new(&x_source_funcs, sizeof(struct x_source));
+	struct x_source *xs = (struct x_source*)source;
+	xs->panel = panel;
+	xs->poll_fd.fd = ConnectionNumber(panel->connection.dpy);
+	xs->poll_fd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	g_source_add_poll(source, &xs->poll_fd);
+	g_source_attach(source, 0);
+	g_source_unref(source);
 
 	g_main_loop_run(panel->loop);
 	g_main_loop_unref(panel->loop);
 }
 
+static int64_t cpu_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* replays recorded trace as fast as possible, every batch is followed by a
+ * redraw (if required), timers are not run */
+void panel_replay_trace(struct panel *panel)
+{
+	unsigned int events = 0, batches = 0;
+	int64_t wall = profile_now();
+	int64_t cpu = cpu_time();
+	int n;
+
+	while ((n = process_events(panel)) > 0) {
+		events += n;
+		batches++;
+		if (panel_needs_redraw(panel))
+			expose_panel(panel);
+	}
+	XSync(panel->connection.dpy, False);
+
+	wall = profile_now() - wall;
+	cpu = cpu_time() - cpu;
+	printf("replayed %u events in %u batches\n", events, batches);
+	printf("cpu time: %lld.%03lld ms, wall time: %lld.%03lld ms\n",
+	       (long long)(cpu / 1000), (long long)(cpu % 1000),
+	       (long long)(wall / 1000), (long long)(wall % 1000));
+	if (trace_desyncs())
+		printf("desyncs: %u (trace was recorded with another "
+		       "config, theme or version?)\n", trace_desyncs());
+	fflush(stdout);
+}
+
@@ -0,0 +1,251 @@
+#include <time.h>
+#include "util.h"
+
+int profile_enabled;
+
+static struct profile_hist *hists;
+static struct profile_site *sites;
+
+/* innermost active scope, round trips are charged to the whole chain */
+static struct profile_scope *current_scope;
+
+/**************************************************************************
+  Histograms
+**************************************************************************/
+
+int64_t profile_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Histograms are looked up by (group, name) pair. Callers always pass string
+ * literals or interface names, which live for the whole process, so pointer
+ * comparison catches almost everything. The list is short (a few dozen
+ * entries), linear search is fine.
+ */
+struct profile_hist *profile_get_hist(const char *group, const char *name)
+{
+	struct profile_hist *h;
+	for (h = hists; h; h = h->next) {
+		if (h->group == group && h->name == name)
+			return h;
+	}
+	for (h = hists; h; h = h->next) {
+		if (!strcmp(h->group, group) && !strcmp(h->name, name))
+			return h;
+	}
+
+	h = xmallocz(sizeof(struct profile_hist));
+	h->group = group;
+	h->name = name;
+	h->next = hists;
+	hists = h;
+	return h;
+}
+
+void profile_record(struct profile_hist *h, int64_t usec)
+{
+	unsigned int bucket = 0;
+	uint64_t v = (usec > 0) ? (uint64_t)usec : 0;
+
+	/* bucket N holds [2^N, 2^(N+1)) microseconds, bucket 0 also gets 0 */
+	while (v > 1 && bucket < PROFILE_BUCKETS - 1) {
+		v >>= 1;
+		bucket++;
+	}
+
+	h->buckets[bucket]++;
+	h->count++;
+	h->total += usec;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+/* scopes are always properly nested (they live on the C stack) */
+void profile_begin(struct profile_scope *s, const char *group, const char *name)
+{
+	s->hist = profile_get_hist(group, name);
+	s->parent = current_scope;
+	current_scope = s;
+	s->start = profile_now();
+}
+
+void profile_end(struct profile_scope *s)
+{
+	if (!s->hist)
+		return;
+	profile_record(s->hist, profile_now() - s->start);
+	current_scope = s->parent;
+	s->hist = 0;
+}
+
+/**************************************************************************
+  Round trips
+**************************************************************************/
+
+void profile_round_trip(const char *site)
+{
+	struct profile_site *ps;
+	struct profile_scope *s;
+
+	for (ps = sites; ps; ps = ps->next) {
+		if (ps->name == site)
+			break;
+	}
+	if (!ps) {
+		ps = xmallocz(sizeof(struct profile_site));
+		ps->name = site;
+		ps->next = sites;
+		sites = ps;
+	}
+	ps->count++;
+
+	for (s = current_scope; s; s = s->parent)
+		s->hist->round_trips++;
+}
+
+void free_profile()
+{
+	while (hists) {
+		struct profile_hist *next = hists->next;
+		xfree(hists);
+		hists = next;
+	}
+	while (sites) {
+		struct profile_site *next = sites->next;
+		xfree(sites);
+		sites = next;
+	}
+}
+
+/**************************************************************************
+  Report
+**************************************************************************/
+
+static void print_bucket_range(char *buf, size_t size, unsigned int bucket)
+{
+	uint64_t lo = (bucket) ? (uint64_t)1 << bucket : 0;
+	uint64_t hi = (uint64_t)1 << (bucket + 1);
+
+	if (bucket == PROFILE_BUCKETS - 1)
+		snprintf(buf, size, ">= %llu us", (unsigned long long)lo);
+	else
+		snprintf(buf, size, "%llu - %llu us", (unsigned long long)lo,
+			 (unsigned long long)hi - 1);
+	buf[size-1] = '\0';
+}
+
+static void print_hist(struct profile_hist *h)
+{
+	char name[64];
+	unsigned int i, top = 0;
+
+	snprintf(name, sizeof(name), "%s: %s", h->group, h->name);
+	name[sizeof(name)-1] = '\0';
+
+	printf("┏━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━┓\n");
+	printf("┃ %-71s ┃\n", name);
+	printf("┠─────────────────────────────────────────────────────────────────────────┨\n");
+	printf("┃ Count:       %-58u ┃\n", h->count);
+	printf("┃ Total (us):  %-58lld ┃\n", (long long)h->total);
+	printf("┃ Avg (us):    %-58lld ┃\n", (long long)(h->total / h->count));
+	printf("┃ Max (us):    %-58lld ┃\n", (long long)h->max);
+	if (h->round_trips) {
+		char rt[64];
+		snprintf(rt, sizeof(rt), "%u (%.2f per call)", h->round_trips,
+			 (double)h->round_trips / h->count);
+		rt[sizeof(rt)-1] = '\0';
+		printf("┃ Round trips: %-58s ┃\n", rt);
+	}
+	printf("┠──────────────────────┬────────────┬─────────────────────────────────────┨\n");
+
+	for (i = 0; i < PROFILE_BUCKETS; ++i) {
+		if (h->buckets[i] > top)
+			top = h->buckets[i];
+	}
+	for (i = 0; i < PROFILE_BUCKETS; ++i) {
+		char range[32];
+		char bar[36];
+		unsigned int len;
+
+		if (!h->buckets[i])
+			continue;
+
+		print_bucket_range(range, sizeof(range), i);
+		len = (unsigned int)((uint64_t)h->buckets[i] * 35 / top);
+		if (!len)
+			len = 1;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		printf("┃ %20s │ %10u │ %-35s ┃\n", range, h->buckets[i], bar);
+	}
+	printf("┗━━━━━━━━━━━━━━━━━━━━━━┷━━━━━━━━━━━━┷━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━┛\n");
+}
+
+static int compare_hists_total(const void *a, const void *b)
+{
+	const struct profile_hist *ha = *(const struct profile_hist**)a;
+	const struct profile_hist *hb = *(const struct profile_hist**)b;
+
+	if (ha->total == hb->total)
+		return 0;
+	return (ha->total < hb->total) ? 1 : -1;
+}
+
+static void print_sites()
+{
+	struct profile_site *ps;
+	unsigned int total = 0;
+
+	if (!sites)
+		return;
+
+	printf("┏━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━┯━━━━━━━━━━━━┓\n");
+	printf("┃ X round trips                                              │      count ┃\n");
+	printf("┠────────────────────────────────────────────────────────────┼────────────┨\n");
+	for (ps = sites; ps; ps = ps->next) {
+		printf("┃ %-58s │ %10u ┃\n", ps->name, ps->count);
+		total += ps->count;
+	}
+	printf("┠────────────────────────────────────────────────────────────┼────────────┨\n");
+	printf("┃ %-58s │ %10u ┃\n", "Total", total);
+	printf("┗━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━┷━━━━━━━━━━━━┛\n");
+}
+
+void xprofstat()
+{
+	struct profile_hist *h;
+	struct profile_hist **sorted;
+	size_t i, n = 0;
+
+	if (!profile_enabled)
+		return;
+
+	print_sites();
+
+	for (h = hists; h; h = h->next) {
+		if (h->count)
+			n++;
+	}
+	if (!n) {
+		fflush(stdout);
+		return;
+	}
+
+	/* most expensive first */
+	sorted = xmalloc(sizeof(struct profile_hist*) * n);
+	n = 0;
+	for (h = hists; h; h = h->next) {
+		if (h->count)
+			sorted[n++] = h;
+	}
+	qsort(sorted, n, sizeof(struct profile_hist*), compare_hists_total);
+
+	for (i = 0; i < n; ++i)
+		print_hist(sorted[i]);
+	xfree(sorted);
+	fflush(stdout);
+}
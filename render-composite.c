@@ -0,0 +1,99 @@
+#include "gui.h"
+#include "widget-utils.h"
+
+static void create_dc(struct panel *p);
+static void blit(struct panel *p, int x, int y, unsigned int w, unsigned int h);
+static void create_private(struct panel *p);
+static void free_private(struct panel *p);
+static void panel_resize(struct panel *p);
+
+/*
+ * Real transparency, used when a composite manager is running. The window
+ * and p->bg are ARGB, widgets are rendered with alpha and the composite
+ * manager blends the panel with whatever is below it, no wallpaper copies.
+ */
+struct render_interface render_composite = {
+	.name = "composite",
+	.create_dc = create_dc,
+	.blit = blit,
+	.create_private = create_private,
+	.free_private = free_private,
+	.panel_resize = panel_resize
+};
+
+/*
+ * blit_cr is a real p->bg interface
+ */
+struct composite_render {
+	cairo_t *blit_cr;
+};
+
+static void create_private(struct panel *p)
+{
+	struct composite_render *rp = xmallocz(sizeof(struct composite_render));
+
+	rp->blit_cr = create_cairo_for_panel_pixmap(p, p->bg);
+	/* alpha replaces the previous contents, not blends with it */
+	cairo_set_operator(rp->blit_cr, CAIRO_OPERATOR_SOURCE);
+	p->render_private = (void*)rp;
+}
+
+static void free_private(struct panel *p)
+{
+	struct composite_render *rp = p->render_private;
+	cairo_destroy(rp->blit_cr);
+	xfree(rp);
+}
+
+static void create_dc(struct panel *p)
+{
+	cairo_surface_t *backbuf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							      p->width, p->height);
+
+	p->cr = cairo_create(backbuf);
+	cairo_surface_destroy(backbuf);
+}
+
+static void blit(struct panel *p, int x, int y, unsigned int w, unsigned int h)
+{
+	Display *dpy = p->connection.dpy;
+	struct composite_render *rp = p->render_private;
+
+	/* put gui to the background pixmap as is */
+	if (p->client_side_rendering)
+		upload_panel_area(p, cairo_get_target(p->cr), x, y, w, h);
+	else
+		blit_image_ex(cairo_get_target(p->cr), rp->blit_cr,
+			      x, y, w, h, x, y);
+
+	/* clear blitted area only, the rest is either clear already or
+	 * waiting for its own blit */
+	cairo_save(p->cr);
+	cairo_set_operator(p->cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(p->cr, 0, 0, 0, 0);
+	cairo_rectangle(p->cr, x, y, w, h);
+	cairo_fill(p->cr);
+	cairo_restore(p->cr);
+
+	XClearArea(dpy, p->win, x, y, w, h, False);
+}
+
+static void panel_resize(struct panel *p)
+{
+	struct x_connection *c = &p->connection;
+	struct composite_render *rp = p->render_private;
+
+	/* p->cr */
+	cairo_destroy(p->cr);
+	create_dc(p);
+
+	/* p->bg */
+	XFreePixmap(c->dpy, p->bg);
+	p->bg = create_panel_pixmap(p);
+	XSetWindowBackgroundPixmap(c->dpy, p->win, p->bg);
+
+	/* rp->blit_cr */
+	cairo_destroy(rp->blit_cr);
+	rp->blit_cr = create_cairo_for_panel_pixmap(p, p->bg);
+	cairo_set_operator(rp->blit_cr, CAIRO_OPERATOR_SOURCE);
+}
@@ -14,12 +14,16 @@ struct render_interface render_normal = {
 
 static void create_dc(struct panel *p)
 {
-	p->cr = create_cairo_for_pixmap(&p->connection, p->bg,
-					p->width, p->height);
+	if (p->client_side_rendering)
+		p->cr = create_cairo_for_panel_image(p);
+	else
+		p->cr = create_cairo_for_panel_pixmap(p, p->bg);
 }
 
 static void blit(struct panel *p, int x, int y, unsigned int w, unsigned int h)
 {
+	if (p->client_side_rendering)
+		upload_panel_area(p, cairo_get_target(p->cr), x, y, w, h);
 	XClearArea(p->connection.dpy, p->win, x, y, w, h, False);
 }
 
@@ -30,7 +34,7 @@ static void panel_resize(struct panel *p)
 	cairo_destroy(p->cr);
 	XFreePixmap(c->dpy, p->bg);
 
-	p->bg = x_create_default_pixmap(c, p->width, p->height);
+	p->bg = create_panel_pixmap(p);
 	XSetWindowBackgroundPixmap(c->dpy, p->win, p->bg);
-	p->cr = create_cairo_for_pixmap(c, p->bg, p->width, p->height);
+	create_dc(p);
 }
@@ -20,40 +20,97 @@ struct render_interface render_pseudo = {
 
 /*
  * blit_cr is a real p->bg interface
- * backbuf is a storage for p->cr
+ * buf_cr is a client-side buffer where the gui is composited with the
+ * wallpaper, wallpaper is a client-side copy of the root pixmap part under
+ * the panel
  */
 struct pseudo_render {
-	Pixmap buf;
 	cairo_t *buf_cr;
 	cairo_t *blit_cr;
 	cairo_surface_t *wallpaper;
 };
 
+static cairo_t *create_buffer(struct panel *p)
+{
+	cairo_surface_t *buf = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+							  p->width, p->height);
+	ENSURE(cairo_surface_status(buf) == CAIRO_STATUS_SUCCESS,
+	       "Failed to create cairo image surface");
+
+	cairo_t *cr = cairo_create(buf);
+	cairo_surface_destroy(buf);
+	return cr;
+}
+
+/*
+ * Reads the part of the root pixmap under the panel once per root pixmap
+ * change or panel move, blits use the copy and never make the X server
+ * read the (possibly huge) root pixmap again. Parts of the panel outside of
+ * the pixmap stay black.
+ */
+static void update_wallpaper(struct panel *p)
+{
+	struct x_connection *c = &p->connection;
+	struct pseudo_render *pr = p->render_private;
+	struct x_image *img;
+	unsigned int pw, ph, depth;
+	int x1, y1, x2, y2;
+
+	if (pr->wallpaper)
+		cairo_surface_destroy(pr->wallpaper);
+	pr->wallpaper = 0;
+
+	if (c->root_pixmap == None)
+		return;
+
+	/* new image surfaces are cleared, black for RGB24 */
+	pr->wallpaper = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+						   p->width, p->height);
+	ENSURE(cairo_surface_status(pr->wallpaper) == CAIRO_STATUS_SUCCESS,
+	       "Failed to create cairo image surface");
+
+	if (!x_get_geometry(c, c->root_pixmap, &pw, &ph, &depth) ||
+	    depth != (unsigned int)c->default_depth)
+		return;
+
+	x1 = (p->x > 0) ? p->x : 0;
+	y1 = (p->y > 0) ? p->y : 0;
+	x2 = p->x + p->width;
+	y2 = p->y + p->height;
+	if (x2 > (int)pw)
+		x2 = pw;
+	if (y2 > (int)ph)
+		y2 = ph;
+	if (x2 <= x1 || y2 <= y1)
+		return;
+
+	img = x_create_image(c, c->default_visual, c->default_depth,
+			     x2 - x1, y2 - y1);
+	if (x_get_image(c, c->root_pixmap, img, x1, y1) == 0)
+		copy_x_image_to_surface(img->ximage, pr->wallpaper,
+					x1 - p->x, y1 - p->y);
+	x_destroy_image(c, img);
+}
+
 static void create_private(struct panel *p)
 {
 	struct x_connection *c = &p->connection;
 	struct pseudo_render *pr = xmallocz(sizeof(struct pseudo_render));
 
-	pr->blit_cr = create_cairo_for_pixmap(c, p->bg, p->width, p->height);
-	pr->buf = x_create_default_pixmap(c, p->width, p->height);
-	pr->buf_cr = create_cairo_for_pixmap(c, pr->buf, p->width, p->height);
-
-	if (c->root_pixmap != None)
-		pr->wallpaper = create_cairo_surface_for_pixmap(c, c->root_pixmap,
-								c->screen_width,
-								c->screen_height);
+	pr->blit_cr = create_cairo_for_panel_pixmap(p, p->bg);
+	pr->buf_cr = create_buffer(p);
 	p->render_private = (void*)pr;
+
+	update_wallpaper(p);
 }
 
 static void free_private(struct panel *p)
 {
-	Display *dpy = p->connection.dpy;
 	struct pseudo_render *pr = p->render_private;
 	cairo_destroy(pr->buf_cr);
 	cairo_destroy(pr->blit_cr);
 	if (pr->wallpaper)
 		cairo_surface_destroy(pr->wallpaper);
-	XFreePixmap(dpy, pr->buf);
 	xfree(pr);
 }
 
@@ -73,38 +130,38 @@ static void blit(struct panel *p, int x, int y, unsigned int w, unsigned int h)
 
 	/* draw wallpaper or clear buffer */
 	if (pr->wallpaper) {
-		blit_image_ex(pr->wallpaper, pr->buf_cr, p->x + x, p->y + y,
-			      w, h, x, y);
+		blit_image_ex(pr->wallpaper, pr->buf_cr, x, y, w, h, x, y);
 	} else {
 		cairo_save(pr->buf_cr);
 		cairo_set_source_rgb(pr->buf_cr, 0,0,0);
-		cairo_paint(pr->buf_cr);
+		cairo_rectangle(pr->buf_cr, x, y, w, h);
+		cairo_fill(pr->buf_cr);
 		cairo_restore(pr->buf_cr);
 	}
 	/* composite gui with background */
 	blit_image_ex(cairo_get_target(p->cr), pr->buf_cr, x, y, w, h, x, y);
+
+	/* clear blitted area only, the rest is either clear already or
+	 * waiting for its own blit */
 	cairo_save(p->cr);
 	cairo_set_operator(p->cr, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source_rgba(p->cr, 0, 0, 0, 0);
-	cairo_paint(p->cr);
+	cairo_rectangle(p->cr, x, y, w, h);
+	cairo_fill(p->cr);
 	cairo_restore(p->cr);
 
-	/* put everything to the background pixmap and clear area */
-	blit_image_ex(cairo_get_target(pr->buf_cr), pr->blit_cr, x, y, w, h, x, y);
+	/* upload the result to the background pixmap and clear area */
+	if (p->client_side_rendering)
+		upload_panel_area(p, cairo_get_target(pr->buf_cr), x, y, w, h);
+	else
+		blit_image_ex(cairo_get_target(pr->buf_cr), pr->blit_cr,
+			      x, y, w, h, x, y);
 	XClearArea(dpy, p->win, x, y, w, h, False);
 }
 
 static void update_bg(struct panel *p)
 {
-	struct x_connection *c = &p->connection;
-	struct pseudo_render *pr = p->render_private;
-
-	cairo_surface_destroy(pr->wallpaper);
-
-	if (c->root_pixmap != None)
-		pr->wallpaper = create_cairo_surface_for_pixmap(c, c->root_pixmap,
-								c->screen_width,
-								c->screen_height);
+	update_wallpaper(p);
 	p->needs_expose = 1;
 }
 
@@ -113,7 +170,7 @@ static void panel_resize(struct panel *p)
 	struct x_connection *c = &p->connection;
 	struct pseudo_render *pr = (struct pseudo_render*)p->render_private;
 
-	/* pr->wallpaper */
+	/* pr->wallpaper, the panel has probably moved as well */
 	update_bg(p);
 
 	/* p->cr */
@@ -126,18 +183,14 @@ static void panel_resize(struct panel *p)
 
 	/* p->bg */
 	XFreePixmap(c->dpy, p->bg);
-	p->bg = x_create_default_pixmap(c, p->width, p->height);
+	p->bg = create_panel_pixmap(p);
 	XSetWindowBackgroundPixmap(c->dpy, p->win, p->bg);
 
 	/* pr->blit_cr */
 	cairo_destroy(pr->blit_cr);
-	pr->blit_cr = create_cairo_for_pixmap(c, p->bg, p->width, p->height);
-
-	/* pr->buf */
-	XFreePixmap(c->dpy, pr->buf);
-	pr->buf = x_create_default_pixmap(c, p->width, p->height);
+	pr->blit_cr = create_cairo_for_panel_pixmap(p, p->bg);
 
 	/* pr->buf_cr */
 	cairo_destroy(pr->buf_cr);
-	pr->buf_cr = create_cairo_for_pixmap(c, pr->buf, p->width, p->height);
+	pr->buf_cr = create_buffer(p);
 }
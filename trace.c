@@ -0,0 +1,425 @@
+#include "trace.h"
+
+#define TRACE_MAGIC "BMPTRACE"
+#define TRACE_VERSION 2
+
+enum trace_record_type {
+	TRACE_REC_NONE,
+	TRACE_REC_CONNECTION,
+	TRACE_REC_PANEL_WINDOW,
+	TRACE_REC_EVENTS,
+	TRACE_REC_PROP,
+	TRACE_REC_REPLY
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t long_size;
+	uint32_t event_size;
+};
+
+/* record heads, written as is */
+struct trace_prop_head {
+	uint32_t win;
+	uint32_t prop;
+	int32_t items;
+	uint32_t items_after;
+	int32_t format;
+	uint32_t size;
+};
+
+struct trace_reply_head {
+	uint32_t op;
+	uint32_t win;
+	int32_t status;
+	int32_t v[4];
+};
+
+int trace_mode;
+
+static FILE *trace_file;
+static unsigned int desyncs;
+
+/* replay state */
+struct window_map {
+	Window from;
+	Window to;
+};
+
+static struct window_map root_map;
+static struct window_map panel_map;
+
+static Atom *recorded_atoms;
+static const Atom *current_atoms;
+static size_t atoms_n;
+
+/* current (peeked) record */
+static int rec_type;
+static struct trace_prop_head rec_prop;
+static struct trace_reply_head rec_reply;
+static void *rec_data;
+static size_t rec_data_alloc;
+static XEvent *rec_events;
+static int rec_events_n;
+static int rec_events_offset;
+
+/**************************************************************************
+  I/O
+**************************************************************************/
+
+static void write_or_die(const void *data, size_t size)
+{
+	if (size && fwrite(data, size, 1, trace_file) != 1)
+		XDIE("Failed to write trace");
+}
+
+static int read_data(void *data, size_t size)
+{
+	if (!size)
+		return 0;
+	return (fread(data, size, 1, trace_file) == 1) ? 0 : -1;
+}
+
+static void write_record_type(int type)
+{
+	uint8_t t = type;
+	write_or_die(&t, 1);
+}
+
+static void *reserve_rec_data(size_t size)
+{
+	/* never zero, empty properties still have data */
+	if (!rec_data || size > rec_data_alloc) {
+		if (rec_data)
+			xfree(rec_data);
+		rec_data_alloc = size + 1;
+		rec_data = xmalloc(rec_data_alloc);
+	}
+	return rec_data;
+}
+
+/* reads next record to rec_* vars, unless it's already there */
+static int peek_record()
+{
+	uint8_t t;
+	uint32_t n;
+
+	if (rec_type != TRACE_REC_NONE)
+		return rec_type;
+
+	if (read_data(&t, 1) < 0)
+		return TRACE_REC_NONE;
+
+	switch (t) {
+	case TRACE_REC_CONNECTION:
+		/* handled by trace_connection */
+		break;
+	case TRACE_REC_PANEL_WINDOW:
+		if (read_data(&n, sizeof(n)) < 0)
+			return TRACE_REC_NONE;
+		panel_map.from = n;
+		break;
+	case TRACE_REC_EVENTS:
+		if (read_data(&n, sizeof(n)) < 0)
+			return TRACE_REC_NONE;
+		if (rec_events)
+			xfree(rec_events);
+		rec_events = xmalloc(sizeof(XEvent) * n);
+		if (read_data(rec_events, sizeof(XEvent) * n) < 0)
+			return TRACE_REC_NONE;
+		rec_events_n = n;
+		rec_events_offset = 0;
+		break;
+	case TRACE_REC_PROP:
+		if (read_data(&rec_prop, sizeof(rec_prop)) < 0)
+			return TRACE_REC_NONE;
+		if (read_data(reserve_rec_data(rec_prop.size), rec_prop.size) < 0)
+			return TRACE_REC_NONE;
+		break;
+	case TRACE_REC_REPLY:
+		if (read_data(&rec_reply, sizeof(rec_reply)) < 0)
+			return TRACE_REC_NONE;
+		break;
+	default:
+		XDIE("Corrupted trace (unknown record type: %d)", t);
+	}
+
+	rec_type = t;
+	return rec_type;
+}
+
+static void consume_record()
+{
+	rec_type = TRACE_REC_NONE;
+}
+
+/**************************************************************************
+  Mapping
+**************************************************************************/
+
+static Window map_window(Window win)
+{
+	if (win && win == root_map.from)
+		return root_map.to;
+	if (win && win == panel_map.from)
+		return panel_map.to;
+	return win;
+}
+
+static Atom map_atom(Atom atom)
+{
+	size_t i;
+	for (i = 0; i < atoms_n; ++i) {
+		if (recorded_atoms[i] == atom)
+			return current_atoms[i];
+	}
+	return atom;
+}
+
+/* recorded X server may have different atoms, root and panel windows */
+static void map_event(Display *dpy, XEvent *e)
+{
+	e->xany.display = dpy;
+	e->xany.window = map_window(e->xany.window);
+
+	switch (e->type) {
+	case ButtonPress:
+	case ButtonRelease:
+		e->xbutton.root = map_window(e->xbutton.root);
+		break;
+	case MotionNotify:
+		e->xmotion.root = map_window(e->xmotion.root);
+		break;
+	case EnterNotify:
+	case LeaveNotify:
+		e->xcrossing.root = map_window(e->xcrossing.root);
+		break;
+	case PropertyNotify:
+		e->xproperty.atom = map_atom(e->xproperty.atom);
+		break;
+	case ClientMessage:
+		e->xclient.message_type = map_atom(e->xclient.message_type);
+		break;
+	case ConfigureNotify:
+		e->xconfigure.window = map_window(e->xconfigure.window);
+		break;
+	case DestroyNotify:
+		e->xdestroywindow.window = map_window(e->xdestroywindow.window);
+		break;
+	default:
+		break;
+	}
+}
+
+/**************************************************************************
+  Interface
+**************************************************************************/
+
+void trace_open(const char *file, int mode)
+{
+	struct trace_header h;
+
+	trace_file = fopen(file, (mode == TRACE_RECORD) ? "wb" : "rb");
+	if (!trace_file)
+		XDIE("Failed to open trace file: \"%s\"", file);
+
+	if (mode == TRACE_RECORD) {
+		CLEAR_STRUCT(&h);
+		memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+		h.version = TRACE_VERSION;
+		h.long_size = sizeof(long);
+		h.event_size = sizeof(XEvent);
+		write_or_die(&h, sizeof(h));
+	} else {
+		if (read_data(&h, sizeof(h)) < 0 ||
+		    memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)))
+			XDIE("Not a bmpanel2 trace: \"%s\"", file);
+		if (h.version != TRACE_VERSION)
+			XDIE("Unsupported trace version: %u", h.version);
+		if (h.long_size != sizeof(long) ||
+		    h.event_size != sizeof(XEvent))
+			XDIE("Trace was recorded on a different architecture");
+	}
+	trace_mode = mode;
+}
+
+void trace_close()
+{
+	if (!trace_file)
+		return;
+
+	fclose(trace_file);
+	trace_file = 0;
+	trace_mode = TRACE_OFF;
+
+	if (rec_data)
+		xfree(rec_data);
+	if (rec_events)
+		xfree(rec_events);
+	if (recorded_atoms)
+		xfree(recorded_atoms);
+	rec_data = 0;
+	rec_data_alloc = 0;
+	rec_events = 0;
+	recorded_atoms = 0;
+}
+
+void trace_connection(Window root, const Atom *atoms, size_t n)
+{
+	uint32_t v;
+	size_t i;
+
+	if (trace_mode == TRACE_RECORD) {
+		write_record_type(TRACE_REC_CONNECTION);
+		v = root;
+		write_or_die(&v, sizeof(v));
+		v = n;
+		write_or_die(&v, sizeof(v));
+		for (i = 0; i < n; ++i) {
+			v = atoms[i];
+			write_or_die(&v, sizeof(v));
+		}
+	} else if (trace_mode == TRACE_REPLAY) {
+		if (peek_record() != TRACE_REC_CONNECTION)
+			XDIE("Corrupted trace (connection info is missing)");
+		consume_record();
+
+		if (read_data(&v, sizeof(v)) < 0)
+			XDIE("Corrupted trace (truncated connection info)");
+		root_map.from = v;
+		root_map.to = root;
+		if (read_data(&v, sizeof(v)) < 0 || v != n)
+			XDIE("Trace was recorded by another bmpanel2 version");
+
+		recorded_atoms = xmalloc(sizeof(Atom) * n);
+		current_atoms = atoms;
+		atoms_n = n;
+		for (i = 0; i < n; ++i) {
+			if (read_data(&v, sizeof(v)) < 0)
+				XDIE("Corrupted trace (truncated connection info)");
+			recorded_atoms[i] = v;
+		}
+	}
+}
+
+void trace_panel_window(Window win)
+{
+	uint32_t v;
+
+	if (trace_mode == TRACE_RECORD) {
+		write_record_type(TRACE_REC_PANEL_WINDOW);
+		v = win;
+		write_or_die(&v, sizeof(v));
+	} else if (trace_mode == TRACE_REPLAY) {
+		if (peek_record() == TRACE_REC_PANEL_WINDOW) {
+			consume_record();
+			panel_map.to = win;
+		} else {
+			desyncs++;
+		}
+	}
+}
+
+void trace_write_events(XEvent *events, int n)
+{
+	uint32_t v = n;
+
+	write_record_type(TRACE_REC_EVENTS);
+	write_or_die(&v, sizeof(v));
+	write_or_die(events, sizeof(XEvent) * n);
+
+	/* batch is the unit of replay, keep the trace usable after a crash */
+	fflush(trace_file);
+}
+
+int trace_read_events(Display *dpy, XEvent *events, int max)
+{
+	int type, n = 0;
+
+	/* skip requests made during recording, but not during replay */
+	while ((type = peek_record()) != TRACE_REC_EVENTS) {
+		if (type == TRACE_REC_NONE)
+			return 0;
+		desyncs++;
+		consume_record();
+	}
+
+	while (n < max && rec_events_offset < rec_events_n) {
+		events[n] = rec_events[rec_events_offset++];
+		map_event(dpy, &events[n]);
+		n++;
+	}
+	if (rec_events_offset == rec_events_n)
+		consume_record();
+	return n;
+}
+
+void trace_write_prop(Window win, Atom prop, const struct trace_prop *tp)
+{
+	struct trace_prop_head h;
+
+	h.win = win;
+	h.prop = prop;
+	h.items = tp->items;
+	h.items_after = tp->items_after;
+	h.format = (tp->data) ? tp->format : 0;
+	h.size = (tp->data) ? tp->size : 0;
+
+	write_record_type(TRACE_REC_PROP);
+	write_or_die(&h, sizeof(h));
+	write_or_die(tp->data, h.size);
+}
+
+int trace_read_prop(Window win, Atom prop, struct trace_prop *tp)
+{
+	if (peek_record() != TRACE_REC_PROP ||
+	    map_window(rec_prop.win) != win ||
+	    map_atom(rec_prop.prop) != prop)
+	{
+		desyncs++;
+		return -1;
+	}
+	consume_record();
+
+	tp->items = rec_prop.items;
+	tp->items_after = rec_prop.items_after;
+	tp->format = rec_prop.format;
+	tp->size = rec_prop.size;
+	tp->data = (rec_prop.format) ? rec_data : 0;
+	return 0;
+}
+
+void trace_write_reply(int op, Window win, const struct trace_reply *tr)
+{
+	struct trace_reply_head h;
+
+	h.op = op;
+	h.win = win;
+	h.status = tr->status;
+	memcpy(h.v, tr->v, sizeof(h.v));
+
+	write_record_type(TRACE_REC_REPLY);
+	write_or_die(&h, sizeof(h));
+}
+
+int trace_read_reply(int op, Window win, struct trace_reply *tr)
+{
+	if (peek_record() != TRACE_REC_REPLY ||
+	    rec_reply.op != (uint32_t)op ||
+	    map_window(rec_reply.win) != win)
+	{
+		desyncs++;
+		return -1;
+	}
+	consume_record();
+
+	tr->status = rec_reply.status;
+	memcpy(tr->v, rec_reply.v, sizeof(tr->v));
+	return 0;
+}
+
+unsigned int trace_desyncs()
+{
+	return desyncs;
+}
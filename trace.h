@@ -0,0 +1,78 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include "util.h"
+
+/*
+ * X event trace recorder and replayer.
+ *
+ * In record mode every batch of XEvents the panel receives is written to a
+ * trace file, together with the replies to all client state requests
+ * (properties, window attributes, geometry, coordinates) in the order they
+ * were made. In replay mode the panel still renders to a real display, but
+ * events come from the trace and client state requests are answered from it
+ * as well, no other X clients are required. Since the panel is
+ * deterministic, requests made during replay match recorded ones, if they
+ * don't (e.g. a different theme or config), it's reported as a desync and
+ * the trace resyncs at the next event batch.
+ *
+ * Traces contain raw Xlib structures, they are specific to the architecture
+ * they were recorded on.
+ */
+
+enum trace_mode {
+	TRACE_OFF,
+	TRACE_RECORD,
+	TRACE_REPLAY
+};
+
+enum trace_reply_op {
+	TRACE_OP_ATTRIBUTES,	/* width, height, your_event_mask, map_state */
+	TRACE_OP_EVENT_MASK,	/* your_event_mask */
+	TRACE_OP_GEOMETRY,	/* width, height, depth */
+	TRACE_OP_COORDINATES,	/* x, y */
+	TRACE_OP_SCAN_GEOMETRY	/* x, y, width, height */
+};
+
+/* fixed size reply to a request about window state */
+struct trace_reply {
+	int status;
+	int v[4];
+};
+
+/*
+ * Property reply, "data" is zero if the property is missing or has another
+ * type. Data layout is the Xlib one (format 32 items are longs).
+ */
+struct trace_prop {
+	int items;
+	unsigned long items_after;
+	int format;
+	size_t size;
+	void *data;
+};
+
+extern int trace_mode;
+
+void trace_open(const char *file, int mode);
+void trace_close();
+
+/* called once the connection is established, before any other request */
+void trace_connection(Window root, const Atom *atoms, size_t atoms_n);
+void trace_panel_window(Window win);
+
+void trace_write_events(XEvent *events, int n);
+/* returns number of events read, zero at the end of trace */
+int trace_read_events(Display *dpy, XEvent *events, int max);
+
+/*
+ * Replay functions return zero and fill the reply if the next recorded
+ * request matches, otherwise the request counts as desync. Property data
+ * points to an internal buffer, valid until the next trace call.
+ */
+void trace_write_prop(Window win, Atom prop, const struct trace_prop *tp);
+int trace_read_prop(Window win, Atom prop, struct trace_prop *tp);
+void trace_write_reply(int op, Window win, const struct trace_reply *tr);
+int trace_read_reply(int op, Window win, struct trace_reply *tr);
+
+unsigned int trace_desyncs();
@@ -156,3 +156,79 @@ extern struct memory_source msrc_default;
  * "details" boolean for detailed statistics (memleaks).
  */
 void xmemstat(struct memory_source **sources, size_t n, int details);
+
+/**************************************************************************
+  profiling utils
+**************************************************************************/
+
+/*
+ * Latency histograms, enabled at runtime (see "--profile"). Bucket N counts
+ * samples in [2^N, 2^(N+1)) microseconds, the last one is open-ended.
+ */
+#define PROFILE_BUCKETS 24
+
+struct profile_hist {
+	const char *group;
+	const char *name;
+	unsigned int count;
+	int64_t total;
+	int64_t max;
+	unsigned int buckets[PROFILE_BUCKETS];
+	unsigned int round_trips; /* including nested scopes */
+	struct profile_hist *next;
+};
+
+struct profile_scope {
+	struct profile_hist *hist;
+	int64_t start;
+	struct profile_scope *parent;
+};
+
+/* X round trips made at a particular call site */
+struct profile_site {
+	const char *name;
+	unsigned int count;
+	struct profile_site *next;
+};
+
+extern int profile_enabled;
+
+/* monotonic time in microseconds */
+int64_t profile_now();
+struct profile_hist *profile_get_hist(const char *group, const char *name);
+void profile_record(struct profile_hist *h, int64_t usec);
+void profile_begin(struct profile_scope *s, const char *group, const char *name);
+void profile_end(struct profile_scope *s);
+void profile_round_trip(const char *site);
+
+/*
+ * Time a code block, "group" and "name" must outlive the process (string
+ * literals, interface names). Cost is a single branch when profiling is off.
+ */
+#define PROFILE_BEGIN(scope, group, name)				\
+do {									\
+	(scope)->hist = 0;						\
+	if (profile_enabled)						\
+		profile_begin((scope), (group), (name));		\
+} while (0)
+
+#define PROFILE_END(scope)						\
+do {									\
+	if ((scope)->hist)						\
+		profile_end(scope);					\
+} while (0)
+
+/*
+ * Count a blocking X request at "site" (string literal). It is charged to
+ * every active scope, so an event handler includes round trips made by
+ * the widget callbacks it invoked.
+ */
+#define PROFILE_ROUND_TRIP(site)					\
+do {									\
+	if (profile_enabled)						\
+		profile_round_trip(site);				\
+} while (0)
+
+/* Prints out round trip totals and latency histograms, most expensive first. */
+void xprofstat();
+void free_profile();
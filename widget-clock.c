@@ -55,6 +55,33 @@ static void fill_buftime(char *buf, size_t size, struct clock_theme *ct)
 	strftime(buf, size, ct->time_format, localtime(&current_time));
 }
 
+/* returns non-zero if strftime format changes more often than once a minute */
+static int format_has_seconds(const char *fmt)
+{
+	for (; *fmt; ++fmt) {
+		if (*fmt != '%')
+			continue;
+		fmt++;
+		/* flags, field width and E/O modifiers */
+		while (*fmt && strchr("_-0^#EO123456789", *fmt))
+			fmt++;
+		if (!*fmt)
+			break;
+		if (strchr("sSTrXc+", *fmt))
+			return 1;
+	}
+	return 0;
+}
+
+/* wake up exactly at the next second or minute boundary */
+static void schedule_clock_tick(struct widget *w)
+{
+	struct clock_widget *cw = (struct clock_widget*)w->private;
+	gint64 period = cw->has_seconds ? 1000 : 60000;
+	gint64 now = g_get_real_time() / 1000;
+	widget_schedule_tick(w, period - now % period);
+}
+
 static int get_clock_width(struct widget *w, const char *bufover)
 {
 	struct clock_widget *cw = (struct clock_widget*)w->private;
@@ -92,6 +119,9 @@ static int create_widget_private(struct widget *w, struct config_format_entry *e
 
 	w->private = cw;
 	w->width = get_clock_width(w, 0);
+
+	cw->has_seconds = format_has_seconds(cw->theme.time_format);
+	schedule_clock_tick(w);
 	return 0;
 }
 
@@ -155,6 +185,8 @@ static void clock_tick(struct widget *w)
 	static char buflasttime[128];
 	char buftime[128];
 
+	schedule_clock_tick(w);
+
 	time_t current_time;
 	current_time = time(0);
 	strftime(buftime, sizeof(buftime), cw->theme.time_format, localtime(&current_time));
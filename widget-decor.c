@@ -10,7 +10,8 @@ struct widget_interface decor_interface = {
 	.size_type		= WIDGET_SIZE_CONSTANT,
 	.create_widget_private	= create_widget_private,
 	.destroy_widget_private = destroy_widget_private,
-	.draw			= draw
+	.draw			= draw,
+	.static_draw		= 1
 };
 
 /**************************************************************************
@@ -237,6 +237,14 @@ static int create_widget_private(struct widget *w, struct config_format_entry *e
 	resize_desktops(w);
 	dw->highlighted = -1;
 
+	/* PropertyNotify interests, see prop_change */
+	widget_select_prop(w, WIDGET_PROP_ROOT,
+			   c->atoms[XATOM_NET_NUMBER_OF_DESKTOPS]);
+	widget_select_prop(w, WIDGET_PROP_ROOT,
+			   c->atoms[XATOM_NET_DESKTOP_NAMES]);
+	widget_select_prop(w, WIDGET_PROP_ROOT,
+			   c->atoms[XATOM_NET_CURRENT_DESKTOP]);
+
 	return 0;
 }
 
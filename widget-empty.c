@@ -8,7 +8,8 @@ struct widget_interface empty_interface = {
 	.theme_name		= "empty",
 	.size_type		= WIDGET_SIZE_CONSTANT,
 	.create_widget_private	= create_widget_private,
-	.destroy_widget_private = destroy_widget_private
+	.destroy_widget_private = destroy_widget_private,
+	.static_draw		= 1
 };
 
 /**************************************************************************
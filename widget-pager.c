@@ -108,18 +108,22 @@ static void free_pager_theme(struct pager_theme *pt)
   Tasks management
 **************************************************************************/
 
-static gboolean task_remove_dead(Window *win, struct pager_task *t, void *notused)
+static gboolean task_remove_dead(Window *win, struct pager_task *t,
+				 struct widget *w)
 {
 	if (t->alive) {
 		t->alive = 0;
 		return 0;
 	}
+	panel_untrack_window(w, t->win);
 	xfree(t);
 	return 1;
 }
 
-static gboolean task_remove_all(Window *win, struct pager_task *t, void *notused)
+static gboolean task_remove_all(Window *win, struct pager_task *t,
+				struct widget *w)
 {
+	panel_untrack_window(w, t->win);
 	xfree(t);
 	return 1;
 }
@@ -127,7 +131,7 @@ static gboolean task_remove_all(Window *win, struct pager_task *t, void *notused
 static void get_window_position(struct x_connection *c, struct pager_task *t, Window win)
 {
 	XWindowAttributes winattrs;
-	XGetWindowAttributes(c->dpy, win, &winattrs);
+	x_get_window_attributes(c, win, &winattrs);
 	t->w = winattrs.width;
 	t->h = winattrs.height;
 	x_translate_coordinates(c, 0, 0, &t->x, &t->y, win);
@@ -141,14 +145,6 @@ static void get_window_position(struct x_connection *c, struct pager_task *t, Wi
 	}
 }
 
-static void select_window_input(struct x_connection *c, Window win)
-{
-	XWindowAttributes winattrs;
-	XGetWindowAttributes(c->dpy, win, &winattrs);
-	long mask = winattrs.your_event_mask | PropertyChangeMask | StructureNotifyMask;
-	XSelectInput(c->dpy, win, mask);
-}
-
 static int update_tasks(struct widget *w)
 {
 	struct x_connection *c = &w->panel->connection;
@@ -164,6 +160,12 @@ static int update_tasks(struct widget *w)
 	int needs_expose = 0;
 	size_t i;
 	struct pager_task *t;
+
+	/* new windows are scanned all at once */
+	Window *newwins = xmalloc(sizeof(Window) * pw->windows_n);
+	size_t *newpos = xmalloc(sizeof(size_t) * pw->windows_n);
+	size_t newwins_n = 0;
+
 	for (i = 0; i < pw->windows_n; ++i) {
 		Window win = pw->windows[i];
 		t = g_hash_table_lookup(pw->tasks, &win);
@@ -174,28 +176,51 @@ static int update_tasks(struct widget *w)
 				needs_expose = 1;
 			}
 		} else {
+			newpos[newwins_n] = i;
+			newwins[newwins_n++] = win;
+		}
+	}
+
+	if (newwins_n) {
+		struct x_window_info *infos =
+			xmalloc(sizeof(struct x_window_info) * newwins_n);
+		x_scan_windows(c, newwins, newwins_n, infos,
+			       X_SCAN_FRAME_EXTENTS);
+
+		for (i = 0; i < newwins_n; ++i) {
+			struct x_window_info *info = &infos[i];
+			long *extents = info->frame_extents;
+
 			t = xmallocz(sizeof(struct pager_task));
-			select_window_input(c, win);
-			get_window_position(c, t, win);
-			t->win = win;
+			t->win = info->win;
+			t->x = info->x - extents[0];
+			t->y = info->y - extents[2];
+			t->w = info->width + extents[0] + extents[1];
+			t->h = info->height + extents[2] + extents[3];
 			t->alive = 1;
-			t->desktop = x_get_window_desktop(c, win);
-			t->visible = x_is_window_visible_on_screen(c, win);
-			t->visible_on_panel = x_is_window_visible_on_panel(c, win);
-			t->stackpos = i;
+			t->desktop = info->desktop;
+			t->visible = info->visible_on_screen;
+			t->visible_on_panel = info->visible_on_panel;
+			t->stackpos = newpos[i];
 
 			g_hash_table_insert(pw->tasks, &t->win, t);
-			needs_expose = 1;
+			panel_track_window(w, t->win);
 		}
+		x_free_window_infos(infos, newwins_n);
+		xfree(infos);
+		needs_expose = 1;
 	}
+	xfree(newwins);
+	xfree(newpos);
 
-	g_hash_table_foreach_remove(pw->tasks, (GHRFunc)task_remove_dead, 0);
+	g_hash_table_foreach_remove(pw->tasks, (GHRFunc)task_remove_dead, w);
 	return needs_expose;
 }
 
-static void clear_tasks(struct pager_widget *pw)
+static void clear_tasks(struct widget *w)
 {
-	g_hash_table_foreach_remove(pw->tasks, (GHRFunc)task_remove_all, 0);
+	struct pager_widget *pw = (struct pager_widget*)w->private;
+	g_hash_table_foreach_remove(pw->tasks, (GHRFunc)task_remove_all, w);
 	g_hash_table_destroy(pw->tasks);
 	if (pw->windows)
 		XFree(pw->windows);
@@ -315,6 +340,7 @@ static int create_widget_private(struct widget *w, struct config_format_entry *e
 	}
 
 	INIT_ARRAY(pw->desktops, 16);
+	init_rect_batch(&pw->batch);
 	w->private = pw;
 
 	pw->current_monitor_only = parse_bool("pager_current_monitor_only", &g_settings.root);
@@ -327,6 +353,22 @@ static int create_widget_private(struct widget *w, struct config_format_entry *e
 	pw->tasks = g_hash_table_new(g_int_hash, g_int_equal);
 	update_tasks(w);
 
+	/* PropertyNotify interests, see prop_change */
+	widget_select_prop(w, WIDGET_PROP_ROOT,
+			   c->atoms[XATOM_NET_NUMBER_OF_DESKTOPS]);
+	widget_select_prop(w, WIDGET_PROP_ROOT, c->atoms[XATOM_NET_WORKAREA]);
+	widget_select_prop(w, WIDGET_PROP_ROOT,
+			   c->atoms[XATOM_NET_ACTIVE_WINDOW]);
+	widget_select_prop(w, WIDGET_PROP_ROOT,
+			   c->atoms[XATOM_NET_CURRENT_DESKTOP]);
+	widget_select_prop(w, WIDGET_PROP_ROOT,
+			   c->atoms[XATOM_NET_CLIENT_LIST_STACKING]);
+	widget_select_prop(w, WIDGET_PROP_CLIENT,
+			   c->atoms[XATOM_NET_WM_DESKTOP]);
+	widget_select_prop(w, WIDGET_PROP_CLIENT, c->atoms[XATOM_NET_WM_STATE]);
+	widget_select_prop(w, WIDGET_PROP_CLIENT,
+			   c->atoms[XATOM_NET_FRAME_EXTENTS]);
+
 	return 0;
 }
 
@@ -336,10 +378,26 @@ static void destroy_widget_private(struct widget *w)
 	free_pager_theme(&pw->theme);
 	free_desktops(pw);
 	FREE_ARRAY(pw->desktops);
-	clear_tasks(pw);
+	free_rect_batch(&pw->batch);
+	clear_tasks(w);
 	xfree(pw);
 }
 
+static struct pager_state *get_desktop_state(struct pager_widget *pw, size_t i)
+{
+	int state = (i == pw->active) << 1;
+	int state_hl = ((i == pw->active) << 1) | (i == pw->highlighted);
+
+	if (pw->theme.states[state_hl].exists)
+		return &pw->theme.states[state_hl];
+	return &pw->theme.states[state];
+}
+
+/*
+ * Rectangles go to the batch and are drawn with a few cairo calls per
+ * color. Numbers are drawn after that, each one within its own desktop,
+ * followed by the active desktop border on top of everything.
+ */
 static void draw(struct widget *w)
 {
 	struct pager_widget *pw = (struct pager_widget*)w->private;
@@ -356,18 +414,11 @@ static void draw(struct widget *w)
 
 	for (i = 0; i < pw->desktops_n; ++i) {
 		struct pager_desktop *pd = &pw->desktops[i];
-		int state = (i == pw->active) << 1;
-		int state_hl = ((i == pw->active) << 1) | (i == pw->highlighted);
-		struct pager_state *ps;
-
-		if (pw->theme.states[state_hl].exists)
-			ps = &pw->theme.states[state_hl];
-		else
-			ps = &pw->theme.states[state];
+		struct pager_state *ps = get_desktop_state(pw, i);
 
 		pd->x = r.x;
 		r.w = pd->w;
-		fill_rectangle(cr, ps->fill, &r);
+		batch_fill_rectangle(&pw->batch, ps->fill, &r);
 
 		if (pw->active == i) {
 			activerect = r;
@@ -402,21 +453,32 @@ static void draw(struct widget *w)
 					window_fill = ps->inactive_window_fill;
 					window_border = ps->inactive_window_border;
 				}
-				fill_rectangle(cr, window_fill, &intersection);
-				draw_rectangle_outline(cr, window_border, &intersection);
+				batch_fill_rectangle(&pw->batch, window_fill,
+						     &intersection);
+				batch_rectangle_outline(&pw->batch, window_border,
+							&intersection);
 			}
 		}
+		pd->num_tasks = visible_tasks_count;
 
 		r.x--; r.y--; r.w += 2; r.h += 2;
 
-		draw_rectangle_outline(cr, ps->border, &r);
-		if (ps->font.pfd && visible_tasks_count) {
+		batch_rectangle_outline(&pw->batch, ps->border, &r);
+		r.x += r.w + pw->theme.desktop_spacing;
+	}
+	flush_rect_batch(&pw->batch, cr);
+
+	for (i = 0; i < pw->desktops_n; ++i) {
+		struct pager_desktop *pd = &pw->desktops[i];
+		struct pager_state *ps = get_desktop_state(pw, i);
+
+		if (ps->font.pfd && pd->num_tasks) {
 			/* draw number */
 			char buf[10];
-			snprintf(buf, sizeof(buf), "%zu", visible_tasks_count);
-			draw_text(cr, layout, &ps->font, buf, r.x, r.y, r.w, r.h, 0);
+			snprintf(buf, sizeof(buf), "%d", pd->num_tasks);
+			draw_text(cr, layout, &ps->font, buf, pd->x, r.y,
+				  pd->w, r.h, 0);
 		}
-		r.x += r.w + pw->theme.desktop_spacing;
 	}
 	draw_rectangle_outline(cr, activeps->border, &activerect);
 }
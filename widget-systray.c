@@ -71,6 +71,7 @@ static void add_tray_icon(struct widget *w, Window win)
 	XMapRaised(c->dpy, icon.icon);
 
 	ARRAY_APPEND(sw->icons, icon);
+	panel_track_window(w, win);
 }
 
 static void update_systray_width(struct widget *w)
@@ -103,6 +104,7 @@ static void free_tray_icon(struct widget *w, Window win)
 
 	int i = find_tray_icon(sw, win);
 	if (i != -1) {
+		panel_untrack_window(w, win);
 		XDestroyWindow(c->dpy, sw->icons[i].embedder);
 		ARRAY_REMOVE(sw->icons, i);
 	}
@@ -116,6 +118,7 @@ static void free_tray_icons(struct widget *w)
 	size_t i;
 	for (i = 0; i < sw->icons_n; ++i) {
 		struct systray_icon *ic = &sw->icons[i];
+		panel_untrack_window(w, ic->icon);
 		XReparentWindow(c->dpy, ic->icon, c->root, 0, 0);
 		XDestroyWindow(c->dpy, ic->embedder);
 	}
@@ -183,7 +186,7 @@ static int create_widget_private(struct widget *w, struct config_format_entry *e
 	x_set_prop_int(c, sw->selection_owner, orientatom,
 		       NET_SYSTEM_TRAY_ORIENTATION_HORZ);
 	x_set_prop_visualid(c, sw->selection_owner, visualatom,
-			    XVisualIDFromVisual(c->default_visual));
+			    XVisualIDFromVisual(w->panel->visual));
 
 	/* inform other clients that we're here */
 	XEvent ev;
@@ -332,5 +335,10 @@ static int retheme_reconfigure(struct widget *w, struct config_format_entry *e,
 	free_systray_theme(st);
 	*st = tmptheme;
 	update_systray_width(w);
+
+	/* panel forgets tracked windows on reconfiguration */
+	size_t i;
+	for (i = 0; i < sw->icons_n; ++i)
+		panel_track_window(w, sw->icons[i].icon);
 	return 0;
 }
@@ -204,71 +204,235 @@ static int find_last_task_by_desktop(struct taskbar_widget *tw, int desktop)
 	return t;
 }
 
-static void add_task(struct widget *w, struct x_connection *c, Window win)
+/* blinking timer is running only while some task demands attention */
+static void schedule_blink(struct widget *w)
 {
 	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
-	struct taskbar_task t;
+	size_t i;
 
-	x_set_error_trap();
-	if (!x_is_window_visible_on_panel(c, win)) {
-		if (x_done_error_trap())
-			return;
-		// we need this if window will apear later
-		if (w->panel->win != win)
-			XSelectInput(c->dpy, win, PropertyChangeMask);
+	if (!tw->task_urgency_hint || w->next_tick)
 		return;
+
+	for (i = 0; i < tw->tasks_n; ++i) {
+		if (tw->tasks[i].demands_attention > 0) {
+			gint64 now = g_get_real_time() / 1000;
+			widget_schedule_tick(w, 1000 - now % 1000);
+			return;
+		}
 	}
+}
 
+/* Windows are scanned all at once, invisible ones are being watched as well,
+ * they may appear later. */
+static void add_tasks(struct widget *w, struct x_connection *c,
+		      const Window *wins, size_t n)
+{
+	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
+	struct x_window_info *infos = xmalloc(sizeof(struct x_window_info) * n);
+	size_t i;
 
-	XWindowAttributes winattrs;
-	XGetWindowAttributes(c->dpy, win, &winattrs);
-	long mask = winattrs.your_event_mask | PropertyChangeMask | StructureNotifyMask;
-	XSelectInput(c->dpy, win, mask);
-	XGetWindowAttributes(c->dpy, win, &winattrs); /* get position after select input */
+	x_scan_windows(c, wins, n, infos, X_SCAN_NAME);
 
-	CLEAR_STRUCT(&t);
-	t.win = win;
-	t.demands_attention = x_is_window_demands_attention(c, win);
-	int x, y;
-	x_translate_coordinates(c, 0, 0, &x, &y, win);
-	t.monitor = task_monitor(x, y, winattrs.width, winattrs.height,
-				 c->monitors, c->monitors_n);
+	/* icons are loaded later, see update_task_icons */
+	for (i = 0; i < n; ++i) {
+		struct x_window_info *info = &infos[i];
+		struct taskbar_task t;
+		if (!info->alive || !info->visible_on_panel)
+			continue;
 
-	x_realloc_window_name(&t.name, c, win, &t.name_atom, &t.name_type_atom);
-	if (tw->theme.default_icon)
-		t.icon = get_window_icon(c, win, tw->theme.default_icon);
-	else
-		t.icon = 0;
-	t.desktop = x_get_window_desktop(c, win);
+		CLEAR_STRUCT(&t);
+		t.win = info->win;
+		t.demands_attention = info->demands_attention;
+		t.monitor = task_monitor(info->x, info->y,
+					 info->width, info->height,
+					 c->monitors, c->monitors_n);
+
+		t.name_atom = info->name_atom;
+		t.name_type_atom = info->name_type_atom;
+		strbuf_assign(&t.name, info->name ? info->name : "<unknown>");
+		t.desktop = info->desktop;
+		panel_track_window(w, t.win);
+
+		int ti = find_last_task_by_desktop(tw, t.desktop);
+		if (ti == -1)
+			ARRAY_PREPEND(tw->tasks, t);
+		else
+			ARRAY_INSERT_AFTER(tw->tasks, (size_t)ti, t);
+	}
 
-	int i = find_last_task_by_desktop(tw, t.desktop);
-	if (i == -1)
-		ARRAY_PREPEND(tw->tasks, t);
-	else
-		ARRAY_INSERT_AFTER(tw->tasks, (size_t)i, t);
+	x_free_window_infos(infos, n);
+	xfree(infos);
+	schedule_blink(w);
+}
+
+static void add_task(struct widget *w, struct x_connection *c, Window win)
+{
+	add_tasks(w, c, &win, 1);
+}
+
+static void invalidate_task_button(struct taskbar_task *t)
+{
+	if (t->button)
+		cairo_surface_destroy(t->button);
+	t->button = 0;
+}
+
+static void unload_task_icon(struct taskbar_task *t)
+{
+	if (!t->icon)
+		return;
+	cairo_surface_destroy(t->icon);
+	t->icon = 0;
+	t->icon_bytes = 0;
+	invalidate_task_button(t);
 }
 
 static void free_task(struct taskbar_task *t)
 {
 	strbuf_free(&t->name);
-	if (t->icon)
-		cairo_surface_destroy(t->icon);
+	unload_task_icon(t);
+	invalidate_task_button(t);
 }
 
-static void remove_task(struct taskbar_widget *tw, size_t i)
+static void remove_task(struct widget *w, size_t i)
 {
+	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
+	panel_untrack_window(w, tw->tasks[i].win);
 	free_task(&tw->tasks[i]);
 	ARRAY_REMOVE(tw->tasks, i);
 }
 
-static void free_tasks(struct taskbar_widget *tw)
+static void free_tasks(struct widget *w)
 {
+	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
 	size_t i;
-	for (i = 0; i < tw->tasks_n; ++i)
+	for (i = 0; i < tw->tasks_n; ++i) {
+		panel_untrack_window(w, tw->tasks[i].win);
 		free_task(&tw->tasks[i]);
+	}
 	FREE_ARRAY(tw->tasks);
 }
 
+/*
+ * Icons are fetched when a task becomes visible for the first time, tasks on
+ * other desktops and monitors cost nothing until then. Fetching happens in
+ * the event path (update_task_icons is called after events which may change
+ * visibility), draw never talks to the X server. If "task_icon_memory" is
+ * set, icons and rendered buttons of hidden tasks are freed, least recently
+ * visible first, while the total is over the limit, icons are fetched again
+ * once tasks are back. The default icon belongs to the theme and is never
+ * accounted.
+ */
+static size_t task_memory(struct taskbar_task *t)
+{
+	size_t bytes = t->icon_bytes;
+	if (t->button)
+		bytes += image_height(t->button) *
+			 cairo_image_surface_get_stride(t->button);
+	return bytes;
+}
+
+static void load_task_icons(struct widget *w)
+{
+	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
+	struct x_connection *c = &w->panel->connection;
+	cairo_surface_t *default_icon = tw->theme.default_icon;
+	cairo_surface_t **icons;
+	Window *wins;
+	size_t *indices;
+	size_t i, n = 0;
+
+	if (!default_icon)
+		return;
+
+	for (i = 0; i < tw->tasks_n; ++i) {
+		if (!tw->tasks[i].icon && is_task_visible(w, &tw->tasks[i]))
+			n++;
+	}
+	if (!n)
+		return;
+
+	wins = xmalloc(sizeof(Window) * n);
+	indices = xmalloc(sizeof(size_t) * n);
+	icons = xmalloc(sizeof(cairo_surface_t*) * n);
+	for (i = 0, n = 0; i < tw->tasks_n; ++i) {
+		if (!tw->tasks[i].icon && is_task_visible(w, &tw->tasks[i])) {
+			wins[n] = tw->tasks[i].win;
+			indices[n++] = i;
+		}
+	}
+
+	get_window_icons(c, wins, n, default_icon, icons);
+	for (i = 0; i < n; ++i) {
+		struct taskbar_task *t = &tw->tasks[indices[i]];
+		t->icon = icons[i];
+		if (t->icon != default_icon)
+			t->icon_bytes = image_height(t->icon) *
+				cairo_image_surface_get_stride(t->icon);
+		invalidate_task_button(t);
+	}
+
+	xfree(icons);
+	xfree(indices);
+	xfree(wins);
+}
+
+static int compare_tasks_last_visible(const void *a, const void *b)
+{
+	const struct taskbar_task *ta = *(const struct taskbar_task**)a;
+	const struct taskbar_task *tb = *(const struct taskbar_task**)b;
+
+	if (ta->last_visible == tb->last_visible)
+		return 0;
+	return (ta->last_visible < tb->last_visible) ? -1 : 1;
+}
+
+static void evict_task_memory(struct widget *w)
+{
+	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
+	struct taskbar_task **hidden;
+	size_t total = 0;
+	size_t i, n = 0;
+
+	if (!tw->task_icon_memory || !tw->tasks_n)
+		return;
+
+	hidden = xmalloc(sizeof(struct taskbar_task*) * tw->tasks_n);
+	for (i = 0; i < tw->tasks_n; ++i) {
+		struct taskbar_task *t = &tw->tasks[i];
+		size_t bytes = task_memory(t);
+		total += bytes;
+		if (bytes && !is_task_visible(w, t))
+			hidden[n++] = t;
+	}
+
+	if (total > tw->task_icon_memory) {
+		qsort(hidden, n, sizeof(struct taskbar_task*),
+		      compare_tasks_last_visible);
+		/* if visible tasks alone are over the limit, so be it */
+		for (i = 0; i < n && total > tw->task_icon_memory; ++i) {
+			total -= task_memory(hidden[i]);
+			unload_task_icon(hidden[i]);
+			invalidate_task_button(hidden[i]);
+		}
+	}
+	xfree(hidden);
+}
+
+static void update_task_icons(struct widget *w)
+{
+	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
+	size_t i;
+
+	tw->visibility_clock++;
+	for (i = 0; i < tw->tasks_n; ++i) {
+		if (is_task_visible(w, &tw->tasks[i]))
+			tw->tasks[i].last_visible = tw->visibility_clock;
+	}
+	load_task_icons(w);
+	evict_task_memory(w);
+}
+
 static int count_visible_tasks(struct widget *w)
 {
 	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
@@ -289,9 +453,9 @@ static int highlighted_state_exists(struct taskbar_theme *theme, int active)
 	return 0;
 }
 
-static void draw_task(struct taskbar_task *task, struct taskbar_widget *tw,
-		cairo_t *cr, PangoLayout *layout, int x, int w, int active,
-		int highlighted)
+/* returns index of the theme state the task is drawn with */
+static int get_task_state(struct taskbar_task *task, struct taskbar_widget *tw,
+			  int active, int highlighted)
 {
 	struct taskbar_theme *theme = &tw->theme;
 
@@ -307,22 +471,21 @@ static void draw_task(struct taskbar_task *task, struct taskbar_widget *tw,
 		}
 	}
 
-	/* calculations */
 	int state = active << 1;
 	int state_hl = (active << 1) | highlighted;
 
-	struct triple_image *tbt;
-	struct text_info *font;
-	int *icon_offset;
-	if (theme->states[state_hl].exists) {
-		tbt = &theme->states[state_hl].background;
-		font = &theme->states[state_hl].font;
-		icon_offset = theme->states[state_hl].icon_offset;
-	} else {
-		tbt = &theme->states[state].background;
-		font = &theme->states[state].font;
-		icon_offset = theme->states[state].icon_offset;
-	}
+	if (theme->states[state_hl].exists)
+		return state_hl;
+	return state;
+}
+
+static void draw_task(struct taskbar_task *task, struct taskbar_widget *tw,
+		cairo_t *cr, PangoLayout *layout, int x, int w, int state)
+{
+	struct taskbar_theme *theme = &tw->theme;
+	struct triple_image *tbt = &theme->states[state].background;
+	struct text_info *font = &theme->states[state].font;
+	int *icon_offset = theme->states[state].icon_offset;
 
 	int leftw = image_width(tbt->left);
 	int rightw = image_width(tbt->right);
@@ -339,13 +502,13 @@ static void draw_task(struct taskbar_task *task, struct taskbar_widget *tw,
 	int rightx = centerx + centerw;
 
 	if (tbt->stretched_overlap)
-		stretch_image(tbt->center, cr,
-			      leftx + tbt->center_offsets[0], 0,
-			      w - tbt->center_offsets[0] - tbt->center_offsets[1]);
+		stretch_triple_image_center(tbt, cr,
+			leftx + tbt->center_offsets[0], 0,
+			w - tbt->center_offsets[0] - tbt->center_offsets[1]);
 	else if (tbt->stretched)
-		stretch_image(tbt->center, cr,
-			      centerx + tbt->center_offsets[0], 0,
-			      centerw - tbt->center_offsets[0] - tbt->center_offsets[1]);
+		stretch_triple_image_center(tbt, cr,
+			centerx + tbt->center_offsets[0], 0,
+			centerw - tbt->center_offsets[0] - tbt->center_offsets[1]);
 	else
 		pattern_image(tbt->center, cr, centerx, 0, centerw, 1);
 
@@ -360,7 +523,8 @@ static void draw_task(struct taskbar_task *task, struct taskbar_widget *tw,
 		yy += icon_offset[1];
 		cairo_save(cr);
 		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-		blit_image(task->icon, cr, xx, yy);
+		blit_image(task->icon ? task->icon : theme->default_icon,
+			   cr, xx, yy);
 		cairo_restore(cr);
 	}
 	xx += iconw;
@@ -369,6 +533,48 @@ static void draw_task(struct taskbar_task *task, struct taskbar_widget *tw,
 	draw_text(cr, layout, font, task->name.buf, xx, 0, textw, height, 1);
 }
 
+/*
+ * Buttons are rendered to their own surfaces and reused while the state and
+ * width are the same, so that e.g. a hover redraws two buttons, not all of
+ * them. The OVER operator is required for the surface to compose the same
+ * way, with "paint_replace" buttons are drawn directly.
+ */
+static void draw_task_cached(struct taskbar_task *task,
+			     struct taskbar_widget *tw, struct panel *p,
+			     int x, int w, int active, int highlighted)
+{
+	cairo_t *cr = p->cr;
+	int state = get_task_state(task, tw, active, highlighted);
+
+	if (cairo_get_operator(cr) != CAIRO_OPERATOR_OVER) {
+		draw_task(task, tw, cr, p->layout, x, w, state);
+		return;
+	}
+
+	if (task->button && (task->button_state != state ||
+			     task->button_w != w))
+		invalidate_task_button(task);
+
+	if (!task->button) {
+		cairo_t *bcr;
+
+		task->button = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+							  w, p->height);
+		task->button_state = state;
+		task->button_w = w;
+
+		bcr = cairo_create(task->button);
+		draw_task(task, tw, bcr, p->layout, 0, w, state);
+		cairo_destroy(bcr);
+	}
+
+	cairo_save(cr);
+	cairo_set_source_surface(cr, task->button, x, 0);
+	cairo_rectangle(cr, x, 0, w, p->height);
+	cairo_fill(cr);
+	cairo_restore(cr);
+}
+
 static inline void activate_task(struct x_connection *c, struct taskbar_task *t)
 {
 	x_send_netwm_message(c, t->win, c->atoms[XATOM_NET_ACTIVE_WINDOW],
@@ -452,15 +658,22 @@ static void update_tasks(struct widget *w, struct x_connection *c)
 			}
 		}
 		if (delete)
-			remove_task(tw, i--);
+			remove_task(w, i--);
 	}
 
+	/* new ones */
+	Window *newwins = xmalloc(sizeof(Window) * (num + 1));
+	size_t newwins_n = 0;
 	for (j = 0; j < num; ++j) {
 		if (find_task_by_window(tw, wins[j]) == -1)
-			add_task(w, c, wins[j]);
+			newwins[newwins_n++] = wins[j];
 	}
+	if (newwins_n)
+		add_tasks(w, c, newwins, newwins_n);
 
-	XFree(wins);
+	xfree(newwins);
+	if (wins)
+		XFree(wins);
 }
 
 /**************************************************************************
@@ -493,9 +706,42 @@ static int create_widget_private(struct widget *w, struct config_format_entry *e
 	const char *tvmstr = find_config_format_entry_value(&g_settings.root,
 							    "task_visible_monitors");
 	tw->task_visible_monitors = parse_task_visible_monitors(tvmstr);
+	tw->task_icon_memory = (size_t)parse_int("task_icon_memory",
+						 &g_settings.root, 0) * 1024;
 	tw->dnd_cur = XCreateFontCursor(c->dpy, XC_fleur);
 	tw->highlighted = -1;
 
+	/* PropertyNotify interests, see prop_change */
+	static const int root_props[] = {
+		XATOM_NET_ACTIVE_WINDOW,
+		XATOM_NET_CURRENT_DESKTOP,
+		XATOM_NET_CLIENT_LIST
+	};
+	static const int client_props[] = {
+		XATOM_NET_WM_STATE,
+		XATOM_WM_STATE,
+		XATOM_NET_WM_WINDOW_TYPE,
+		XATOM_NET_WM_DESKTOP,
+		XATOM_NET_WM_ICON,
+		/* all name candidates, see x_realloc_window_name */
+		XATOM_NET_WM_VISIBLE_ICON_NAME,
+		XATOM_NET_WM_ICON_NAME,
+		XATOM_NET_WM_VISIBLE_NAME,
+		XATOM_NET_WM_NAME
+	};
+	size_t i;
+	for (i = 0; i < sizeof(root_props) / sizeof(root_props[0]); ++i)
+		widget_select_prop(w, WIDGET_PROP_ROOT,
+				   c->atoms[root_props[i]]);
+	for (i = 0; i < sizeof(client_props) / sizeof(client_props[0]); ++i)
+		widget_select_prop(w, WIDGET_PROP_CLIENT,
+				   c->atoms[client_props[i]]);
+	widget_select_prop(w, WIDGET_PROP_CLIENT, XA_WM_HINTS);
+	widget_select_prop(w, WIDGET_PROP_CLIENT, XA_WM_ICON_NAME);
+	widget_select_prop(w, WIDGET_PROP_CLIENT, XA_WM_NAME);
+
+	update_task_icons(w);
+	schedule_blink(w);
 	return 0;
 }
 
@@ -503,7 +749,7 @@ static void destroy_widget_private(struct widget *w)
 {
 	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
 	free_taskbar_theme(&tw->theme);
-	free_tasks(tw);
+	free_tasks(w);
 	XFreeCursor(w->panel->connection.dpy, tw->dnd_cur);
 	xfree(tw);
 }
@@ -563,8 +809,8 @@ static void draw(struct widget *w)
 		}
 
 
-		draw_task(t, tw, cr, w->panel->layout,
-			  x, taskw, t->win == tw->active, i == tw->highlighted);
+		draw_task_cached(t, tw, p, x, taskw, t->win == tw->active,
+				 i == tw->highlighted);
 		x += taskw;
 		if (sepspace && curtask != count-1) {
 			blit_image(tw->theme.separator, cr, x, 0);
@@ -574,7 +820,7 @@ static void draw(struct widget *w)
 	}
 }
 
-static void prop_change(struct widget *w, XPropertyEvent *e)
+static void task_prop_change(struct widget *w, XPropertyEvent *e)
 {
 	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
 	struct x_connection *c = &w->panel->connection;
@@ -629,6 +875,7 @@ static void prop_change(struct widget *w, XPropertyEvent *e)
 		struct taskbar_task *t = &tw->tasks[ti];
 		x_realloc_window_name(&t->name, c, t->win,
 				      &t->name_atom, &t->name_type_atom);
+		invalidate_task_button(t);
 		w->needs_expose = 1;
 		return;
 	}
@@ -638,9 +885,8 @@ static void prop_change(struct widget *w, XPropertyEvent *e)
 		if (e->atom == c->atoms[XATOM_NET_WM_ICON] ||
 		    e->atom == XA_WM_HINTS)
 		{
-			struct taskbar_task *t = &tw->tasks[ti];
-			cairo_surface_destroy(t->icon);
-			t->icon = get_window_icon(c, t->win, tw->theme.default_icon);
+			/* fetched again right away if visible */
+			unload_task_icon(&tw->tasks[ti]);
 			w->needs_expose = 1;
 			return;
 		}
@@ -650,13 +896,21 @@ static void prop_change(struct widget *w, XPropertyEvent *e)
 	    e->atom == c->atoms[XATOM_WM_STATE]) {
 		struct taskbar_task *t = &tw->tasks[ti];
 		if (!x_is_window_visible_on_panel(c, t->win))
-			remove_task(tw, ti);
+			remove_task(w, ti);
 		t->demands_attention = x_is_window_demands_attention(c, t->win);
+		schedule_blink(w);
 		w->needs_expose = 1;
 		return;
 	}
 }
 
+/* desktop, task list or task state changes may show tasks */
+static void prop_change(struct widget *w, XPropertyEvent *e)
+{
+	task_prop_change(w, e);
+	update_task_icons(w);
+}
+
 static void button_click(struct widget *w, XButtonEvent *e)
 {
 	struct taskbar_widget *tw = (struct taskbar_widget*)w->private;
@@ -858,6 +1112,7 @@ static void clock_tick(struct widget *w)
 			t->demands_attention = 1 + (seconds % 2);
 		}
 	}
+	schedule_blink(w);
 }
 
 static void configure(struct widget *w, XConfigureEvent *e)
@@ -877,7 +1132,7 @@ static void configure(struct widget *w, XConfigureEvent *e)
 
 		/* figure out on which monitor task is located */
 		XWindowAttributes winattrs;
-		XGetWindowAttributes(c->dpy, e->window, &winattrs);
+		x_get_window_attributes(c, e->window, &winattrs);
 
 		int x, y;
 		x_translate_coordinates(c, 0, 0, &x, &y, e->window);
@@ -887,6 +1142,7 @@ static void configure(struct widget *w, XConfigureEvent *e)
 		/* finally if task state is changed: redraw! */
 		if (t->monitor != monitor) {
 			t->monitor = monitor;
+			update_task_icons(w);
 			w->needs_expose = 1;
 		}
 	}
@@ -903,4 +1159,12 @@ static void reconfigure(struct widget *w)
 	const char *tvmstr = find_config_format_entry_value(&g_settings.root,
 							    "task_visible_monitors");
 	tw->task_visible_monitors = parse_task_visible_monitors(tvmstr);
+	tw->task_icon_memory = (size_t)parse_int("task_icon_memory",
+						 &g_settings.root, 0) * 1024;
+	update_task_icons(w);
+
+	if (tw->task_urgency_hint)
+		schedule_blink(w);
+	else
+		widget_cancel_tick(w);
 }
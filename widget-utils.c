@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include "widget-utils.h"
+#include "array.h"
+#include "netwm-icon.h"
 
 /**************************************************************************
   Parsing utils
@@ -152,6 +154,8 @@ int parse_triple_image(struct triple_image *tbt, struct config_format_entry *e,
 	tbt->stretched = parse_bool("stretched", e);
 	tbt->stretched_overlap = parse_bool("stretched_overlap", e);
 	parse_2ints(tbt->center_offsets, "center_offsets", e);
+	memset(tbt->stretch_cache, 0, sizeof(tbt->stretch_cache));
+	tbt->stretch_clock = 0;
 	return 0;
 }
 
@@ -177,6 +181,13 @@ void free_triple_image(struct triple_image *tbt)
 		cairo_surface_destroy(tbt->left);
 	if (tbt->right)
 		cairo_surface_destroy(tbt->right);
+
+	size_t i;
+	for (i = 0; i < STRETCH_CACHE_SIZE; ++i) {
+		if (tbt->stretch_cache[i].surface)
+			cairo_surface_destroy(tbt->stretch_cache[i].surface);
+		tbt->stretch_cache[i].surface = 0;
+	}
 }
 
 int parse_text_info(struct text_info *out, struct config_format_entry *e)
@@ -292,6 +303,158 @@ void for_each_word(char *str, void (*func)(const char*, void*), void *data)
 	}
 }
 
+/**************************************************************************
+  Text layout cache
+**************************************************************************/
+
+/*
+ * Shaping is the most expensive part of text drawing, and widgets draw the
+ * same strings over and over again. Shaped layouts are kept in a bounded
+ * LRU cache keyed by (font, text, width, ellipsize mode). All cached layouts
+ * share the context of the panel layout, which is updated once per draw, so
+ * they get reshaped by pango only if font options really change.
+ */
+
+#define TEXT_CACHE_SIZE 256
+
+struct text_layout {
+	/* key */
+	PangoContext *context;
+	PangoFontDescription *font;
+	char *text;
+	int width;
+	PangoEllipsizeMode ellipsize;
+	guint hash;
+
+	PangoLayout *layout;
+	PangoRectangle extents;
+
+	/* LRU list, head is the most recently used */
+	struct text_layout *prev;
+	struct text_layout *next;
+};
+
+static GHashTable *text_cache;
+static struct text_layout *text_cache_head;
+static struct text_layout *text_cache_tail;
+static size_t text_cache_n;
+
+static guint text_layout_hash(gconstpointer key)
+{
+	return ((const struct text_layout*)key)->hash;
+}
+
+static gboolean text_layout_equal(gconstpointer a, gconstpointer b)
+{
+	const struct text_layout *ta = a;
+	const struct text_layout *tb = b;
+
+	return ta->context == tb->context &&
+	       ta->width == tb->width &&
+	       ta->ellipsize == tb->ellipsize &&
+	       !strcmp(ta->text, tb->text) &&
+	       pango_font_description_equal(ta->font, tb->font);
+}
+
+static void unlink_text_layout(struct text_layout *tl)
+{
+	if (tl->prev)
+		tl->prev->next = tl->next;
+	else
+		text_cache_head = tl->next;
+	if (tl->next)
+		tl->next->prev = tl->prev;
+	else
+		text_cache_tail = tl->prev;
+	tl->prev = tl->next = 0;
+}
+
+static void push_text_layout(struct text_layout *tl)
+{
+	tl->prev = 0;
+	tl->next = text_cache_head;
+	if (text_cache_head)
+		text_cache_head->prev = tl;
+	else
+		text_cache_tail = tl;
+	text_cache_head = tl;
+}
+
+static void free_text_layout(struct text_layout *tl)
+{
+	g_object_unref(tl->layout);
+	pango_font_description_free(tl->font);
+	xfree(tl->text);
+	xfree(tl);
+}
+
+static void evict_text_layout()
+{
+	struct text_layout *tl = text_cache_tail;
+
+	unlink_text_layout(tl);
+	g_hash_table_remove(text_cache, tl);
+	text_cache_n--;
+	free_text_layout(tl);
+}
+
+/* returns a shaped layout, valid until the next call */
+static struct text_layout *get_text_layout(PangoLayout *base,
+		PangoFontDescription *font, const char *text,
+		int width, PangoEllipsizeMode ellipsize)
+{
+	struct text_layout key, *tl;
+
+	key.context = pango_layout_get_context(base);
+	key.font = font;
+	key.text = (char*)text;
+	key.width = width;
+	key.ellipsize = ellipsize;
+	key.hash = g_str_hash(text) ^ pango_font_description_hash(font) ^
+		   (guint)width * 31 ^ (guint)ellipsize;
+
+	if (!text_cache)
+		text_cache = g_hash_table_new(text_layout_hash,
+					      text_layout_equal);
+
+	tl = g_hash_table_lookup(text_cache, &key);
+	if (tl) {
+		unlink_text_layout(tl);
+		push_text_layout(tl);
+		return tl;
+	}
+
+	if (text_cache_n == TEXT_CACHE_SIZE)
+		evict_text_layout();
+
+	tl = xmalloc(sizeof(struct text_layout));
+	*tl = key;
+	tl->font = pango_font_description_copy(font);
+	tl->text = xstrdup(text);
+	tl->layout = pango_layout_new(key.context);
+	pango_layout_set_font_description(tl->layout, tl->font);
+	pango_layout_set_text(tl->layout, tl->text, -1);
+	pango_layout_set_width(tl->layout, width);
+	pango_layout_set_ellipsize(tl->layout, ellipsize);
+	pango_layout_get_pixel_extents(tl->layout, 0, &tl->extents);
+
+	g_hash_table_insert(text_cache, tl, tl);
+	push_text_layout(tl);
+	text_cache_n++;
+	return tl;
+}
+
+void clean_text_cache()
+{
+	if (!text_cache)
+		return;
+
+	while (text_cache_tail)
+		evict_text_layout();
+	g_hash_table_destroy(text_cache);
+	text_cache = 0;
+}
+
 /**************************************************************************
   Drawing utils
 **************************************************************************/
@@ -374,6 +537,54 @@ void stretch_image(cairo_surface_t *src, cairo_t *dest,
 	cairo_restore(dest);
 }
 
+/*
+ * Buttons of the same width are stretched the same way, the scaled center
+ * is rendered once and blitted afterwards. Integer translation of the
+ * result gives exactly the same pixels as stretch_image.
+ */
+void stretch_triple_image_center(struct triple_image *tri, cairo_t *dest,
+				 int dstx, int dsty, int w)
+{
+	struct stretched_image *si = 0;
+	size_t i;
+
+	if (w <= 0)
+		return;
+
+	for (i = 0; i < STRETCH_CACHE_SIZE; ++i) {
+		struct stretched_image *cur = &tri->stretch_cache[i];
+		if (cur->surface && cur->width == w) {
+			si = cur;
+			break;
+		}
+	}
+
+	if (!si) {
+		/* empty slot or the least recently used one */
+		si = &tri->stretch_cache[0];
+		for (i = 0; i < STRETCH_CACHE_SIZE && si->surface; ++i) {
+			struct stretched_image *cur = &tri->stretch_cache[i];
+			if (!cur->surface || cur->last_use < si->last_use)
+				si = cur;
+		}
+		if (si->surface)
+			cairo_surface_destroy(si->surface);
+
+		si->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w,
+						image_height(tri->center));
+		ENSURE(cairo_surface_status(si->surface) == CAIRO_STATUS_SUCCESS,
+		       "Failed to create cairo image surface");
+		si->width = w;
+
+		cairo_t *cr = cairo_create(si->surface);
+		stretch_image(tri->center, cr, 0, 0, w);
+		cairo_destroy(cr);
+	}
+
+	si->last_use = ++tri->stretch_clock;
+	blit_image(si->surface, dest, dstx, dsty);
+}
+
 void draw_text(cairo_t *cr, PangoLayout *dest, struct text_info *ti,
 	       const char *text, int x, int y, int w, int h, int ellipsized)
 {
@@ -383,7 +594,8 @@ void draw_text(cairo_t *cr, PangoLayout *dest, struct text_info *ti,
 		PANGO_ELLIPSIZE_START
 	};
 
-	PangoRectangle r;
+	struct text_layout *tl;
+	PangoLayout *layout;
 	int offsetx = 0, offsety = 0;
 
 	cairo_save(cr);
@@ -391,23 +603,24 @@ void draw_text(cairo_t *cr, PangoLayout *dest, struct text_info *ti,
 			(double)ti->color[0] / 255.0,
 			(double)ti->color[1] / 255.0,
 			(double)ti->color[2] / 255.0);
-	pango_layout_set_font_description(dest, ti->pfd);
-	pango_layout_set_text(dest, text, -1);
-	pango_layout_set_width(dest, -1);
 
-	pango_layout_get_pixel_extents(dest, 0, &r);
+	/* a no-op for pango unless the font options have changed */
+	pango_cairo_update_context(cr, pango_layout_get_context(dest));
+
+	tl = get_text_layout(dest, ti->pfd, text, -1, PANGO_ELLIPSIZE_NONE);
+	layout = tl->layout;
 
-	offsety = (h - r.height) / 2;
+	offsety = (h - tl->extents.height) / 2;
 	switch (ti->align) {
 	default:
 	case ALIGN_CENTER:
-		offsetx = (w - r.width) / 2;
+		offsetx = (w - tl->extents.width) / 2;
 		break;
 	case ALIGN_LEFT:
 		offsetx = 0;
 		break;
 	case ALIGN_RIGHT:
-		offsetx = w - r.width;
+		offsetx = w - tl->extents.width;
 		break;
 	}
 
@@ -422,10 +635,11 @@ void draw_text(cairo_t *cr, PangoLayout *dest, struct text_info *ti,
 	cairo_translate(cr, offsetx, offsety);
 	cairo_clip(cr);
 	if (ellipsized) {
-		pango_layout_set_ellipsize(dest, ellipsize_table[ti->align]);
-		pango_layout_set_width(dest, (w - offsetx) * PANGO_SCALE);
+		tl = get_text_layout(dest, ti->pfd, text,
+				     (w - offsetx) * PANGO_SCALE,
+				     ellipsize_table[ti->align]);
+		layout = tl->layout;
 	}
-	pango_cairo_update_layout(cr, dest);
 
 	if (ti->shadow_offset[0] != 0 || ti->shadow_offset[1] != 0) {
 		cairo_save(cr);
@@ -434,26 +648,23 @@ void draw_text(cairo_t *cr, PangoLayout *dest, struct text_info *ti,
 				(double)ti->shadow_color[0] / 255.0,
 				(double)ti->shadow_color[1] / 255.0,
 				(double)ti->shadow_color[2] / 255.0);
-		pango_cairo_show_layout(cr, dest);
+		pango_cairo_show_layout(cr, layout);
 		cairo_restore(cr);
 	}
 
-	pango_cairo_show_layout(cr, dest);
+	pango_cairo_show_layout(cr, layout);
 	cairo_restore(cr);
 }
 
 void text_extents(PangoLayout *layout, PangoFontDescription *font,
 		const char *text, int *w, int *h)
 {
-	PangoRectangle r;
-	pango_layout_set_font_description(layout, font);
-	pango_layout_set_text(layout, text, -1);
-	pango_layout_set_width(layout, -1);
-	pango_layout_get_pixel_extents(layout, 0, &r);
+	struct text_layout *tl = get_text_layout(layout, font, text, -1,
+						 PANGO_ELLIPSIZE_NONE);
 	if (w)
-		*w = r.width;
+		*w = tl->extents.width;
 	if (h)
-		*h = r.height;
+		*h = tl->extents.height;
 }
 
 void draw_rectangle_outline(cairo_t *cr, unsigned char *color, struct rect *r)
@@ -490,6 +701,117 @@ void fill_rectangle(cairo_t *cr, unsigned char *color, struct rect *r)
 	cairo_restore(cr);
 }
 
+/*
+ * A rectangle joins the latest group of the same style, unless something
+ * drawn after that group overlaps it. Groups are drawn in order, so the
+ * result is the same as drawing rectangles one by one.
+ */
+static void batch_rect(struct rect_batch *b, int outline, unsigned char *color,
+		       struct rect *r)
+{
+	struct rect_batch_group *g = 0;
+	struct rect tmp;
+	size_t i, j;
+
+	for (i = b->groups_n; i > 0; --i) {
+		struct rect_batch_group *cur = &b->groups[i-1];
+		if (cur->outline == outline && !memcmp(cur->color, color, 3)) {
+			g = cur;
+			break;
+		}
+		for (j = 0; j < cur->rects_n; ++j) {
+			if (rect_intersection(&tmp, r, &cur->rects[j]))
+				break;
+		}
+		if (j != cur->rects_n)
+			break;
+	}
+
+	if (!g) {
+		/* groups past groups_n are left from previous flushes, their
+		 * memory is reused */
+		if (b->groups_n == b->groups_used) {
+			ENSURE_ARRAY_CAPACITY(b->groups, b->groups_n + 1);
+			g = &b->groups[b->groups_n];
+			INIT_EMPTY_ARRAY(g->rects);
+			b->groups_used++;
+		} else {
+			g = &b->groups[b->groups_n];
+			CLEAR_ARRAY(g->rects);
+		}
+		g->outline = outline;
+		memcpy(g->color, color, 3);
+		b->groups_n++;
+	}
+	ARRAY_APPEND(g->rects, *r);
+}
+
+void init_rect_batch(struct rect_batch *b)
+{
+	INIT_EMPTY_ARRAY(b->groups);
+	b->groups_used = 0;
+}
+
+void free_rect_batch(struct rect_batch *b)
+{
+	size_t i;
+
+	b->groups_n = b->groups_used;
+	for (i = 0; i < b->groups_n; ++i)
+		FREE_ARRAY(b->groups[i].rects);
+	FREE_ARRAY(b->groups);
+	b->groups_used = 0;
+}
+
+void batch_fill_rectangle(struct rect_batch *b, unsigned char *color,
+			  struct rect *r)
+{
+	batch_rect(b, 0, color, r);
+}
+
+void batch_rectangle_outline(struct rect_batch *b, unsigned char *color,
+			     struct rect *r)
+{
+	batch_rect(b, 1, color, r);
+}
+
+void flush_rect_batch(struct rect_batch *b, cairo_t *cr)
+{
+	size_t i, j;
+
+	if (!b->groups_n)
+		return;
+
+	cairo_save(cr);
+	cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+	cairo_set_line_width(cr, 1);
+	cairo_set_line_cap(cr, CAIRO_LINE_CAP_SQUARE);
+
+	for (i = 0; i < b->groups_n; ++i) {
+		struct rect_batch_group *g = &b->groups[i];
+
+		cairo_new_path(cr);
+		for (j = 0; j < g->rects_n; ++j) {
+			struct rect *r = &g->rects[j];
+			if (g->outline)
+				cairo_rectangle(cr, r->x, r->y, r->w-1, r->h-1);
+			else
+				cairo_rectangle(cr, r->x, r->y, r->w, r->h);
+		}
+		cairo_set_source_rgb(cr,
+				(double)g->color[0] / 255.0,
+				(double)g->color[1] / 255.0,
+				(double)g->color[2] / 255.0);
+		if (g->outline)
+			cairo_stroke(cr);
+		else
+			cairo_fill(cr);
+	}
+
+	cairo_restore(cr);
+	b->groups_n = 0;
+}
+
 /**************************************************************************
   Buffer utils
 **************************************************************************/
@@ -571,9 +893,11 @@ static cairo_surface_t *get_icon_from_netwm(long *data)
 {
 	cairo_surface_t *ret = 0;
 	uint32_t *array = 0;
-	uint32_t w,h,size,i;
+	uint32_t w,h,size;
 	long *locdata = data;
+	struct profile_scope ps;
 
+	/* callers validate the size against the property length */
 	w = *locdata++;
 	h = *locdata++;
 	size = w * h;
@@ -581,19 +905,9 @@ static cairo_surface_t *get_icon_from_netwm(long *data)
 	/* convert netwm icon format to cairo data */
 	/* array = xmalloc(sizeof(uint32_t) * size); */
 	array = get_static_buf_or_xalloc(sizeof(uint32_t) * size);
-	for (i = 0; i < size; ++i) {
-		unsigned char *a, *d;
-		a = (unsigned char*)&array[i];
-		d = (unsigned char*)&locdata[i];
-		a[0] = d[0];
-		a[1] = d[1];
-		a[2] = d[2];
-		a[3] = d[3];
-		/* premultiply alpha */
-		a[0] *= (float)d[3] / 255.0f;
-		a[1] *= (float)d[3] / 255.0f;
-		a[2] *= (float)d[3] / 255.0f;
-	}
+	PROFILE_BEGIN(&ps, "icon", "netwm to argb32");
+	netwm_to_argb32(array, locdata, size);
+	PROFILE_END(&ps);
 
 	int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, w);
 	ret = cairo_image_surface_create_for_data((unsigned char*)array,
@@ -613,14 +927,11 @@ static cairo_surface_t *get_icon_from_netwm(long *data)
 static cairo_surface_t *get_icon_from_pixmap(struct x_connection *c,
 					     Pixmap icon, Pixmap icon_mask)
 {
-	Window root_ret;
-	int x = 0, y = 0;
-	unsigned int w = 0, h = 0, d = 0, bw = 0;
+	unsigned int w = 0, h = 0, d = 0;
 	cairo_surface_t *ret = 0;
 	cairo_surface_t *sicon = 0, *smask = 0;
 
-	XGetGeometry(c->dpy, icon, &root_ret,
-			&x, &y, &w, &h, &bw, &d);
+	x_get_geometry(c, icon, &w, &h, &d);
 
 	/* yep, it is that bad */
 	if (d == 1)
@@ -668,29 +979,251 @@ static cairo_surface_t *get_icon_from_pixmap(struct x_connection *c,
 	return ret;
 }
 
-cairo_surface_t *get_window_icon(struct x_connection *c, Window win,
-		cairo_surface_t *default_icon)
+/*
+ * Windows of the same application usually have byte-identical icons. Resized
+ * _NET_WM_ICON surfaces are shared through a cache keyed by a hash of the
+ * fetched pixels and the target size, so a known icon skips conversion and
+ * scaling. The cache doesn't own surfaces, tasks do, an entry goes away with
+ * the last reference to its surface (cairo user data destroy callback).
+ * Icons are controlled by clients, so the key is a SHA-256 digest of the
+ * pixels, a collision can't be crafted and source pixels don't have to be
+ * kept around for comparison.
+ */
+#define ICON_DIGEST_SIZE 32
+
+struct icon_key {
+	guint8 digest[ICON_DIGEST_SIZE];
+	uint32_t w, h;		/* source image */
+	uint32_t tw, th;	/* resized */
+};
+
+struct cached_icon {
+	struct icon_key key;
+	cairo_surface_t *surface;
+};
+
+static cairo_user_data_key_t cached_icon_key;
+static GHashTable *icon_cache;
+
+static guint icon_key_hash(gconstpointer key)
 {
-	cairo_surface_t *ret = 0;
+	guint hash;
+	memcpy(&hash, ((const struct icon_key*)key)->digest, sizeof(hash));
+	return hash;
+}
+
+static gboolean icon_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct icon_key *ka = a;
+	const struct icon_key *kb = b;
+
+	return ka->w == kb->w && ka->h == kb->h &&
+	       ka->tw == kb->tw && ka->th == kb->th &&
+	       !memcmp(ka->digest, kb->digest, ICON_DIGEST_SIZE);
+}
+
+/* digest of 32 bit pixels, the high half of longs is garbage */
+static void make_icon_key(struct icon_key *key, const long *data,
+			  uint32_t tw, uint32_t th)
+{
+	GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+	uint32_t chunk[256];
+	gsize digest_size = ICON_DIGEST_SIZE;
+	size_t i, n;
+
+	key->w = data[0];
+	key->h = data[1];
+	key->tw = tw;
+	key->th = th;
+
+	n = (size_t)key->w * key->h;
+	data += 2;
+	for (i = 0; i < n; ) {
+		size_t j = 0;
+		while (j < sizeof(chunk) / sizeof(chunk[0]) && i < n)
+			chunk[j++] = data[i++];
+		g_checksum_update(sum, (const guchar*)chunk,
+				  j * sizeof(uint32_t));
+	}
+	g_checksum_get_digest(sum, key->digest, &digest_size);
+	g_checksum_free(sum);
+}
+
+static void uncache_icon(void *ptr)
+{
+	struct cached_icon *ci = ptr;
 
+	g_hash_table_remove(icon_cache, &ci->key);
+	xfree(ci);
+	if (!g_hash_table_size(icon_cache)) {
+		g_hash_table_destroy(icon_cache);
+		icon_cache = 0;
+	}
+}
+
+/* returns a new reference or zero */
+static cairo_surface_t *lookup_cached_icon(const struct icon_key *key)
+{
+	struct cached_icon *ci;
+
+	if (!icon_cache)
+		return 0;
+	ci = g_hash_table_lookup(icon_cache, key);
+	if (!ci)
+		return 0;
+	return cairo_surface_reference(ci->surface);
+}
+
+static void cache_icon(const struct icon_key *key, cairo_surface_t *surface)
+{
+	struct cached_icon *ci = xmalloc(sizeof(struct cached_icon));
+	cairo_status_t st;
+
+	ci->key = *key;
+	ci->surface = surface;
+	st = cairo_surface_set_user_data(surface, &cached_icon_key,
+					 ci, uncache_icon);
+	if (st != CAIRO_STATUS_SUCCESS) {
+		xfree(ci);
+		return;
+	}
+
+	if (!icon_cache)
+		icon_cache = g_hash_table_new(icon_key_hash, icon_key_equal);
+	g_hash_table_insert(icon_cache, &ci->key, ci);
+}
+
+/*
+ * _NET_WM_ICON is an array of images, each one is "width, height" followed
+ * by width * height pixels. Applications often publish several sizes, which
+ * easily adds up to megabytes. Instead of fetching it all, we walk the image
+ * headers with small partial reads, pick the size closest to the default icon
+ * and fetch only that image. The walk is done in rounds for all windows at
+ * once, which keeps XCB requests pipelined.
+ */
+#define NETWM_ICON_MAX_SIZE 1024
+
+struct icon_request {
+	struct x_prop_request icon;
+	struct x_prop_request hints;
+
+	/* header walk state, offsets are in longs */
+	int walking;
+	long next;
+	long best;		/* offset of the chosen image, -1 if none */
+	uint32_t best_w;
+	uint32_t best_h;
+};
+
+/*
+ * The smallest image which is not smaller than the target in both dimensions,
+ * downscaling looks better than upscaling. If there is no such image, the
+ * largest one.
+ */
+static int better_icon_size(uint32_t w, uint32_t h, uint32_t bw, uint32_t bh,
+			    uint32_t tw, uint32_t th)
+{
+	int fits = (w >= tw && h >= th);
+	int bfits = (bw >= tw && bh >= th);
+
+	if (fits != bfits)
+		return fits;
+	if (fits)
+		return w * h < bw * bh;
+	return w * h > bw * bh;
+}
+
+static void send_icon_header_request(struct x_connection *c,
+				      struct icon_request *r)
+{
+	x_send_prop_range_request(c, &r->icon, r->icon.win, r->icon.prop,
+				  XA_CARDINAL, r->next, 2);
+}
+
+/* returns non-zero if there are more headers to read */
+static int get_icon_header_reply(struct x_connection *c,
+				 struct icon_request *r,
+				 uint32_t tw, uint32_t th)
+{
 	int num = 0;
-	long *data = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_ICON],
-			XA_CARDINAL, &num);
+	long *header = x_get_prop_reply(c, &r->icon, &num);
+	uint32_t w, h;
+	long total;
+
+	if (!header)
+		return 0;
+	if (num < 2) {
+		xfree(header);
+		return 0;
+	}
+	w = header[0];
+	h = header[1];
+	xfree(header);
 
-	/* TODO: look for best sized icon? */
-	if (data) {
-		ret = get_icon_from_netwm(data);
-		XFree(data);
+	/* reply tells us how much is left, trust nothing else */
+	total = r->next + num + r->icon.items_after;
+	if (!w || !h || (uint64_t)w * h > (uint64_t)(total - r->next - 2))
+		return 0;
+
+	/* oversized images are skipped, smaller ones may follow */
+	if (w <= NETWM_ICON_MAX_SIZE && h <= NETWM_ICON_MAX_SIZE &&
+	    (r->best < 0 ||
+	     better_icon_size(w, h, r->best_w, r->best_h, tw, th)))
+	{
+		r->best = r->next;
+		r->best_w = w;
+		r->best_h = h;
 	}
 
-	if (!ret) {
-	        XWMHints *hints = XGetWMHints(c->dpy, win);
+	r->next += 2 + (long)w * h;
+	return r->next + 2 <= total;
+}
+
+static cairo_surface_t *get_icon_replies(struct x_connection *c,
+					 struct icon_request *r,
+					 cairo_surface_t *default_icon)
+{
+	cairo_surface_t *ret = 0;
+	struct icon_key key;
+	int cacheable = 0;
+	int num = 0;
+	int w = image_width(default_icon);
+	int h = image_height(default_icon);
+
+	if (r->best >= 0) {
+		long *data = x_get_prop_reply(c, &r->icon, &num);
+		if (data) {
+			if (num == 2 + (long)(r->best_w * r->best_h) &&
+			    (uint32_t)data[0] == r->best_w &&
+			    (uint32_t)data[1] == r->best_h)
+			{
+				make_icon_key(&key, data, w, h);
+				ret = lookup_cached_icon(&key);
+				if (ret) {
+					xfree(data);
+					x_discard_prop_request(c, &r->hints);
+					return ret;
+				}
+				ret = get_icon_from_netwm(data);
+				cacheable = 1;
+			}
+			xfree(data);
+		}
+	}
+
+	/* XWMHints: flags, input, initial_state, icon_pixmap, icon_window,
+	 * icon_x, icon_y, icon_mask, window_group */
+	if (ret) {
+		x_discard_prop_request(c, &r->hints);
+	} else {
+		long *hints = x_get_prop_reply(c, &r->hints, &num);
 		if (hints) {
-			if (hints->flags & IconPixmapHint) {
-				ret = get_icon_from_pixmap(c, hints->icon_pixmap,
-						hints->icon_mask);
+			if (num >= 8 && hints[0] & IconPixmapHint) {
+				ret = get_icon_from_pixmap(c, hints[3],
+						hints[0] & IconMaskHint ?
+						hints[7] : None);
 			}
-			XFree(hints);
+			xfree(hints);
 		}
 	}
 
@@ -699,15 +1232,73 @@ cairo_surface_t *get_window_icon(struct x_connection *c, Window win,
 		return default_icon;
 	}
 
-	int w = image_width(default_icon);
-	int h = image_height(default_icon);
-
 	cairo_surface_t *sizedret = copy_resized(ret, w, h);
 	cairo_surface_destroy(ret);
 
+	if (cacheable)
+		cache_icon(&key, sizedret);
 	return sizedret;
 }
 
+void get_window_icons(struct x_connection *c, const Window *wins, size_t n,
+		      cairo_surface_t *default_icon, cairo_surface_t **icons)
+{
+	struct icon_request *reqs = xmalloc(sizeof(struct icon_request) * n);
+	uint32_t tw = image_width(default_icon);
+	uint32_t th = image_height(default_icon);
+	int walking = n;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		struct icon_request *r = &reqs[i];
+		r->walking = 1;
+		r->next = 0;
+		r->best = -1;
+		r->best_w = r->best_h = 0;
+		x_send_prop_range_request(c, &r->icon, wins[i],
+					  c->atoms[XATOM_NET_WM_ICON],
+					  XA_CARDINAL, 0, 2);
+		x_send_prop_request(c, &r->hints, wins[i],
+				    XA_WM_HINTS, XA_WM_HINTS);
+	}
+
+	/* one round per image in the longest icon list */
+	while (walking) {
+		for (i = 0; i < n; ++i) {
+			struct icon_request *r = &reqs[i];
+			if (!r->walking)
+				continue;
+			r->walking = get_icon_header_reply(c, r, tw, th);
+			if (!r->walking)
+				walking--;
+		}
+		for (i = 0; i < n; ++i) {
+			if (reqs[i].walking)
+				send_icon_header_request(c, &reqs[i]);
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		struct icon_request *r = &reqs[i];
+		if (r->best >= 0)
+			x_send_prop_range_request(c, &r->icon, r->icon.win,
+						  r->icon.prop, XA_CARDINAL,
+						  r->best,
+						  2 + r->best_w * r->best_h);
+	}
+	for (i = 0; i < n; ++i)
+		icons[i] = get_icon_replies(c, &reqs[i], default_icon);
+	xfree(reqs);
+}
+
+cairo_surface_t *get_window_icon(struct x_connection *c, Window win,
+		cairo_surface_t *default_icon)
+{
+	cairo_surface_t *icon;
+	get_window_icons(c, &win, 1, default_icon, &icon);
+	return icon;
+}
+
 cairo_surface_t *copy_resized(cairo_surface_t *source, int w, int h)
 {
 	double dw = (double)w;
@@ -762,6 +1353,132 @@ cairo_surface_t *create_cairo_surface_for_pixmap(struct x_connection *c, Pixmap
 	return surface;
 }
 
+static int native_byte_order()
+{
+	const uint32_t one = 1;
+	return (*(const unsigned char*)&one) ? LSBFirst : MSBFirst;
+}
+
+/* converts a pixel component to 8 bits using its mask */
+static uint32_t mask_component(unsigned long pixel, unsigned long mask)
+{
+	int bits = 0;
+
+	if (!mask)
+		return 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		pixel >>= 1;
+	}
+	pixel &= mask;
+	while (mask & 1) {
+		mask >>= 1;
+		bits++;
+	}
+	return (bits >= 8) ? (pixel >> (bits - 8)) : (pixel << (8 - bits));
+}
+
+void copy_x_image_to_surface(XImage *src, cairo_surface_t *dest,
+			     int dstx, int dsty)
+{
+	unsigned char *data;
+	int stride, x, y;
+	int w = src->width;
+	int h = src->height;
+
+	cairo_surface_flush(dest);
+	data = cairo_image_surface_get_data(dest);
+	stride = cairo_image_surface_get_stride(dest);
+	data += dsty * stride + dstx * 4;
+
+	/* common case, the layout is exactly what cairo uses */
+	if (src->bits_per_pixel == 32 &&
+	    src->red_mask == 0xFF0000 &&
+	    src->green_mask == 0xFF00 &&
+	    src->blue_mask == 0xFF &&
+	    src->byte_order == native_byte_order())
+	{
+		for (y = 0; y < h; ++y)
+			memcpy(data + y * stride,
+			       src->data + y * src->bytes_per_line, w * 4);
+	} else {
+		for (y = 0; y < h; ++y) {
+			uint32_t *row = (uint32_t*)(data + y * stride);
+			for (x = 0; x < w; ++x) {
+				unsigned long p = XGetPixel(src, x, y);
+				row[x] = mask_component(p, src->red_mask) << 16 |
+					 mask_component(p, src->green_mask) << 8 |
+					 mask_component(p, src->blue_mask);
+			}
+		}
+	}
+	cairo_surface_mark_dirty_rectangle(dest, dstx, dsty, w, h);
+}
+
+/* converts 8 bit pixel component to the mask position and width */
+static unsigned long unmask_component(uint32_t v, unsigned long mask)
+{
+	int shift = 0, bits = 0;
+
+	if (!mask)
+		return 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		shift++;
+	}
+	while (mask & 1) {
+		mask >>= 1;
+		bits++;
+	}
+	v = (bits >= 8) ? (v << (bits - 8)) : (v >> (8 - bits));
+	return (unsigned long)v << shift;
+}
+
+void copy_surface_to_x_image(cairo_surface_t *src, XImage *dest,
+			     int x, int y, int w, int h)
+{
+	unsigned char *data;
+	int stride, i, j;
+	/* RGB24 has undefined upper byte, ARGB visuals need it opaque */
+	int opaque = cairo_image_surface_get_format(src) == CAIRO_FORMAT_RGB24;
+
+	cairo_surface_flush(src);
+	data = cairo_image_surface_get_data(src);
+	stride = cairo_image_surface_get_stride(src);
+	data += y * stride + x * 4;
+
+	if (dest->bits_per_pixel == 32 &&
+	    dest->red_mask == 0xFF0000 &&
+	    dest->green_mask == 0xFF00 &&
+	    dest->blue_mask == 0xFF &&
+	    dest->byte_order == native_byte_order())
+	{
+		char *out = dest->data + y * dest->bytes_per_line + x * 4;
+		for (j = 0; j < h; ++j) {
+			const uint32_t *in = (const uint32_t*)(data + j * stride);
+			if (opaque && dest->depth == 32) {
+				uint32_t *o = (uint32_t*)out;
+				for (i = 0; i < w; ++i)
+					o[i] = in[i] | 0xFF000000;
+			} else {
+				memcpy(out, in, w * 4);
+			}
+			out += dest->bytes_per_line;
+		}
+	} else {
+		for (j = 0; j < h; ++j) {
+			const uint32_t *in = (const uint32_t*)(data + j * stride);
+			for (i = 0; i < w; ++i) {
+				uint32_t p = in[i];
+				XPutPixel(dest, x + i, y + j,
+					  unmask_component(p >> 16 & 0xFF, dest->red_mask) |
+					  unmask_component(p >> 8 & 0xFF, dest->green_mask) |
+					  unmask_component(p & 0xFF, dest->blue_mask));
+			}
+		}
+	}
+}
+
 cairo_t *create_cairo_for_bitmap(struct x_connection *c, Pixmap p, int w, int h)
 {
 	cairo_surface_t *surface = cairo_xlib_surface_create_for_bitmap(
@@ -6,6 +6,15 @@
   Parsing utils
 **************************************************************************/
 
+#define STRETCH_CACHE_SIZE 4
+
+/* center image scaled to "width", see stretch_triple_image_center */
+struct stretched_image {
+	cairo_surface_t *surface;
+	int width;
+	unsigned int last_use;
+};
+
 struct triple_image {
 	cairo_surface_t *left;
 	cairo_surface_t *center;
@@ -13,6 +22,10 @@ struct triple_image {
 	int stretched;
 	int stretched_overlap;
 	int center_offsets[2];
+
+	/* LRU of pre-stretched center images */
+	struct stretched_image stretch_cache[STRETCH_CACHE_SIZE];
+	unsigned int stretch_clock;
 };
 
 #define ALIGN_CENTER 0
@@ -104,6 +117,9 @@ void blit_image_ex(cairo_surface_t *src, cairo_t *dest, int srcx, int srcy,
 		   int width, int height, int dstx, int dsty);
 void stretch_image(cairo_surface_t *src, cairo_t *dest,
 		   int dstx, int dsty, int w);
+/* same as stretch_image of tri->center, but scaled images are cached */
+void stretch_triple_image_center(struct triple_image *tri, cairo_t *dest,
+				 int dstx, int dsty, int w);
 void pattern_image(cairo_surface_t *src, cairo_t *dest,
 		   int dstx, int dsty, int w, int align);
 
@@ -111,10 +127,40 @@ void draw_text(cairo_t *cr, PangoLayout *dest, struct text_info *ti,
 	       const char *text, int x, int y, int w, int h, int ellipsized);
 void text_extents(PangoLayout *layout, PangoFontDescription *font,
 		  const char *text, int *w, int *h);
+/* shaped text layouts are cached, free them with the panel layout */
+void clean_text_cache();
 
 void draw_rectangle_outline(cairo_t *cr, unsigned char *color, struct rect *r);
 void fill_rectangle(cairo_t *cr, unsigned char *color, struct rect *r);
 
+/*
+ * Batched solid rectangles: fills and outlines are grouped by color and
+ * each group is drawn with a single cairo fill or stroke, the drawing order
+ * is preserved where rectangles overlap. Memory is kept between flushes.
+ */
+struct rect_batch_group {
+	int outline;
+	unsigned char color[3];
+	struct rect *rects;
+	size_t rects_n;
+	size_t rects_alloc;
+};
+
+struct rect_batch {
+	struct rect_batch_group *groups;
+	size_t groups_n;
+	size_t groups_alloc;
+	size_t groups_used;
+};
+
+void init_rect_batch(struct rect_batch *b);
+void free_rect_batch(struct rect_batch *b);
+void batch_fill_rectangle(struct rect_batch *b, unsigned char *color,
+			  struct rect *r);
+void batch_rectangle_outline(struct rect_batch *b, unsigned char *color,
+			     struct rect *r);
+void flush_rect_batch(struct rect_batch *b, cairo_t *cr);
+
 /**************************************************************************
   X imaging utils
 **************************************************************************/
@@ -123,8 +169,17 @@ cairo_t *create_cairo_for_pixmap(struct x_connection *c, Pixmap p, int w, int h)
 cairo_t *create_cairo_for_bitmap(struct x_connection *c, Pixmap p, int w, int h);
 cairo_surface_t *create_cairo_surface_for_pixmap(struct x_connection *c, Pixmap p,
 						 int w, int h);
+/* dest is an RGB24 image surface, src is in the default visual format */
+void copy_x_image_to_surface(XImage *src, cairo_surface_t *dest,
+			     int dstx, int dsty);
+/* (x,y,w,h) rectangle of an image surface to the same place of dest */
+void copy_surface_to_x_image(cairo_surface_t *src, XImage *dest,
+			     int x, int y, int w, int h);
 cairo_surface_t *get_window_icon(struct x_connection *c, Window win,
 				 cairo_surface_t *default_icon);
+/* same as above, but for many windows at once */
+void get_window_icons(struct x_connection *c, const Window *wins, size_t n,
+		      cairo_surface_t *default_icon, cairo_surface_t **icons);
 cairo_surface_t *copy_resized(cairo_surface_t *source, int w, int h);
 
 /**************************************************************************
@@ -1,4 +1,9 @@
 #include "xutil.h"
+#include "trace.h"
+
+#ifdef HAVE_XCB
+ #include <xcb/xcbext.h>
+#endif
 
 /**************************************************************************
   X error handlers
@@ -60,6 +65,36 @@ static char *atom_names[] = {
 	"XdndStatus"
 };
 
+static size_t prop_item_size(int format)
+{
+	switch (format) {
+	case 32:
+		return sizeof(long);
+	case 16:
+		return sizeof(short);
+	default:
+		return 1;
+	}
+}
+
+static void *replay_prop_data(Window win, Atom prop, int *items)
+{
+	struct trace_prop tp = {0, 0, 0, 0, 0};
+	void *data;
+
+	trace_read_prop(win, prop, &tp);
+	if (items)
+		*items = tp.items;
+	if (!tp.data)
+		return 0;
+
+	/* must be XFree-able, Xlib uses malloc */
+	data = malloc(tp.size + sizeof(long));
+	memset(data, 0, tp.size + sizeof(long));
+	memcpy(data, tp.data, tp.size);
+	return data;
+}
+
 void *x_get_prop_data(struct x_connection *c, Window win, Atom prop,
 		      Atom type, int *items)
 {
@@ -69,8 +104,12 @@ void *x_get_prop_data(struct x_connection *c, Window win, Atom prop,
 	unsigned long after_ret;
 	unsigned char *prop_data;
 
+	if (trace_mode == TRACE_REPLAY)
+		return replay_prop_data(win, prop, items);
+
 	prop_data = 0;
 
+	PROFILE_ROUND_TRIP("x_get_prop_data");
 	XGetWindowProperty(c->dpy, win, prop, 0, 0x7fffffff, False,
 			type, &type_ret, &format_ret, &items_ret,
 			&after_ret, &prop_data);
@@ -79,9 +118,16 @@ void *x_get_prop_data(struct x_connection *c, Window win, Atom prop,
 	if (type != type_ret) {
 		if (prop_data)
 			XFree(prop_data);
-		return 0;
+		prop_data = 0;
 	}
 
+	if (trace_mode == TRACE_RECORD) {
+		struct trace_prop tp = {items_ret,
+			(format_ret) ? after_ret / (format_ret / 8) : 0,
+			format_ret,
+			items_ret * prop_item_size(format_ret), prop_data};
+		trace_write_prop(win, prop, &tp);
+	}
 	return prop_data;
 }
 
@@ -237,6 +283,67 @@ static void init_monitors(struct x_connection *c)
 	*c->monitors = (struct x_monitor){0,0,c->screen_width,c->screen_height};
 }
 
+/**************************************************************************
+  composite manager
+**************************************************************************/
+
+/*
+ * Composite managers own the _NET_WM_CM_S<screen> selection. XFixes reports
+ * ownership changes, without it the state is checked on (re)configuration
+ * only.
+ */
+static void init_composite_manager_watch(struct x_connection *c)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "_NET_WM_CM_S%d", c->screen);
+	c->cm_selection = XInternAtom(c->dpy, name, False);
+
+#ifdef HAVE_XFIXES
+	int error_base;
+	if (!XFixesQueryExtension(c->dpy, &c->xfixes_event_base, &error_base))
+		return;
+
+	XFixesSelectSelectionInput(c->dpy, c->root, c->cm_selection,
+				   XFixesSetSelectionOwnerNotifyMask |
+				   XFixesSelectionWindowDestroyNotifyMask |
+				   XFixesSelectionClientCloseNotifyMask);
+#endif
+}
+
+int x_composite_manager_running(struct x_connection *c)
+{
+	PROFILE_ROUND_TRIP("x_composite_manager_running");
+	return XGetSelectionOwner(c->dpy, c->cm_selection) != None;
+}
+
+int x_is_composite_manager_event(struct x_connection *c, XEvent *e)
+{
+#ifdef HAVE_XFIXES
+	if (c->xfixes_event_base &&
+	    e->type == c->xfixes_event_base + XFixesSelectionNotify)
+		return ((XFixesSelectionNotifyEvent*)e)->selection ==
+			c->cm_selection;
+#endif
+	return 0;
+}
+
+int x_find_argb_visual(struct x_connection *c)
+{
+	XVisualInfo vi;
+
+	if (c->argb_visual)
+		return 0;
+
+	if (!XMatchVisualInfo(c->dpy, c->screen, 32, TrueColor, &vi))
+		return -1;
+
+	c->argb_visual = vi.visual;
+	c->argb_colormap = XCreateColormap(c->dpy, c->root, vi.visual,
+					   AllocNone);
+	return 0;
+}
+
 /**************************************************************************
   *the* interface
 **************************************************************************/
@@ -264,11 +371,17 @@ void x_connect(struct x_connection *c, const char *display)
 	c->default_colormap	= DefaultColormap(c->dpy, c->screen);
 	c->default_depth	= DefaultDepth(c->dpy, c->screen);
 	c->root			= RootWindow(c->dpy, c->screen);
+#ifdef HAVE_XSHM
+	c->shm_available	= XShmQueryExtension(c->dpy);
+	c->shm_event_base	= XShmGetEventBase(c->dpy);
+#endif
+	trace_connection(c->root, c->atoms, XATOM_COUNT);
 	x_update_root_pmap(c);
 
 	XSelectInput(c->dpy, c->root, PropertyChangeMask | StructureNotifyMask);
 
 	init_monitors(c);
+	init_composite_manager_watch(c);
 }
 
 void x_disconnect(struct x_connection *c)
@@ -312,9 +425,10 @@ Window x_create_default_embedder(struct x_connection *c, Window parent,
 {
 	XSetWindowAttributes attrs;
 	attrs.background_pixmap = ParentRelative;
+	/* ParentRelative requires the parent depth, the panel may be ARGB */
 	return XCreateWindow(c->dpy, parent, 0, 0, w, h, 0,
-			     c->default_depth, InputOutput,
-			     c->default_visual, CWBackPixmap, &attrs);
+			     CopyFromParent, InputOutput,
+			     CopyFromParent, CWBackPixmap, &attrs);
 }
 
 void x_set_prop_int(struct x_connection *c, Window win, Atom type, int value)
@@ -343,124 +457,93 @@ void x_set_prop_array(struct x_connection *c, Window win, Atom type,
 			PropModeReplace, (unsigned char*)values, len);
 }
 
-int x_is_window_visible_on_panel(struct x_connection *c, Window win)
+static int is_window_visible(struct x_connection *c, Window win,
+			     int hidden_is_invisible)
 {
+	struct x_prop_request types, wmstate, state;
 	Atom *data;
 	int ret = 1;
 	int num;
 
-	data = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_WINDOW_TYPE],
-			XA_ATOM, &num);
+	x_send_prop_request(c, &types, win, c->atoms[XATOM_NET_WM_WINDOW_TYPE],
+			    XA_ATOM);
+	x_send_prop_request(c, &wmstate, win, c->atoms[XATOM_WM_STATE],
+			    c->atoms[XATOM_WM_STATE]);
+	x_send_prop_request(c, &state, win, c->atoms[XATOM_NET_WM_STATE],
+			    XA_ATOM);
+
+	data = x_get_prop_reply(c, &types, &num);
 	if (data) {
 		while (num) {
 			num--;
 			if (data[num] == c->atoms[XATOM_NET_WM_WINDOW_TYPE_DOCK] ||
 			    data[num] == c->atoms[XATOM_NET_WM_WINDOW_TYPE_DESKTOP])
-			{
-				XFree(data);
-				return 0;
-			}
-
+				ret = 0;
 		}
-		XFree(data);
+		xfree(data);
 	}
 
-	data = x_get_prop_data(c, win, c->atoms[XATOM_WM_STATE],
-			       c->atoms[XATOM_WM_STATE], 0);
+	data = x_get_prop_reply(c, &wmstate, 0);
 	if (data) {
-		if (data[0] == WithdrawnState) {
-			XFree(data);
-			return 0;
-		}
-		XFree(data);
-	}
-
-	data = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_STATE], XA_ATOM, &num);
-	if (!data)
-		return 1;
-
-	while (num) {
-		num--;
-		if (data[num] == c->atoms[XATOM_NET_WM_STATE_SKIP_TASKBAR])
+		if (data[0] == WithdrawnState)
 			ret = 0;
+		xfree(data);
 	}
-	XFree(data);
 
-	return ret;
-}
-
-int x_is_window_visible_on_screen(struct x_connection *c, Window win)
-{
-	Atom *data;
-	int ret = 1;
-	int num;
-
-	data = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_WINDOW_TYPE],
-			XA_ATOM, &num);
+	data = x_get_prop_reply(c, &state, &num);
 	if (data) {
 		while (num) {
 			num--;
-			if (data[num] == c->atoms[XATOM_NET_WM_WINDOW_TYPE_DOCK] ||
-			    data[num] == c->atoms[XATOM_NET_WM_WINDOW_TYPE_DESKTOP])
-			{
-				XFree(data);
-				return 0;
-			}
-
-		}
-		XFree(data);
-	}
-
-	data = x_get_prop_data(c, win, c->atoms[XATOM_WM_STATE],
-			       c->atoms[XATOM_WM_STATE], 0);
-	if (data) {
-		if (data[0] == WithdrawnState) {
-			XFree(data);
-			return 0;
+			if (data[num] == c->atoms[XATOM_NET_WM_STATE_SKIP_TASKBAR])
+				ret = 0;
+			if (hidden_is_invisible &&
+			    data[num] == c->atoms[XATOM_NET_WM_STATE_HIDDEN])
+				ret = 0;
 		}
-		XFree(data);
+		xfree(data);
 	}
 
-	data = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_STATE], XA_ATOM, &num);
-	if (!data)
-		return 1;
+	return ret;
+}
 
-	while (num) {
-		num--;
-		if (data[num] == c->atoms[XATOM_NET_WM_STATE_SKIP_TASKBAR] ||
-		    data[num] == c->atoms[XATOM_NET_WM_STATE_HIDDEN])
-			ret = 0;
-	}
-	XFree(data);
+int x_is_window_visible_on_panel(struct x_connection *c, Window win)
+{
+	return is_window_visible(c, win, 0);
+}
 
-	return ret;
+int x_is_window_visible_on_screen(struct x_connection *c, Window win)
+{
+	return is_window_visible(c, win, 1);
 }
 
 int x_is_window_demands_attention(struct x_connection *c, Window win)
 {
-	Atom *data;
+	struct x_prop_request hints, state;
+	long *data;
 	int ret = 0;
 	int num;
 
-	XWMHints *wmh = XGetWMHints(c->dpy, win);
-	if (wmh) {
-		if (wmh->flags & XUrgencyHint) {
-			XFree(wmh);
-			return 1;
-		}
-		XFree(wmh);
-	}
-
-	data = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_STATE], XA_ATOM, &num);
-	if (!data)
-		return 0;
+	x_send_prop_request(c, &hints, win, XA_WM_HINTS, XA_WM_HINTS);
+	x_send_prop_request(c, &state, win, c->atoms[XATOM_NET_WM_STATE],
+			    XA_ATOM);
 
-	while (num) {
-		num--;
-		if (data[num] == c->atoms[XATOM_NET_WM_STATE_DEMANDS_ATTENTION])
+	/* XWMHints, the first field is flags */
+	data = x_get_prop_reply(c, &hints, &num);
+	if (data) {
+		if (num > 0 && (data[0] & XUrgencyHint))
 			ret = 1;
+		xfree(data);
+	}
+
+	data = x_get_prop_reply(c, &state, &num);
+	if (data) {
+		while (num) {
+			num--;
+			if (data[num] == c->atoms[XATOM_NET_WM_STATE_DEMANDS_ATTENTION])
+				ret = 1;
+		}
+		xfree(data);
 	}
-	XFree(data);
 
 	return ret;
 }
@@ -493,86 +576,88 @@ int x_is_window_iconified(struct x_connection *c, Window win)
 	return ret;
 }
 
+/* window name sources, (atom, type) pairs in order of preference */
+#define NAME_CANDIDATES 8
+
+static void get_name_candidates(struct x_connection *c,
+				Atom candidates[NAME_CANDIDATES][2])
+{
+	const Atom utf8 = c->atoms[XATOM_UTF8_STRING];
+	const Atom tmp[NAME_CANDIDATES][2] = {
+		{c->atoms[XATOM_NET_WM_VISIBLE_ICON_NAME], utf8},
+		{c->atoms[XATOM_NET_WM_ICON_NAME], utf8},
+		{XA_WM_ICON_NAME, XA_STRING},
+		{XA_WM_ICON_NAME, utf8},
+		{c->atoms[XATOM_NET_WM_VISIBLE_NAME], utf8},
+		{c->atoms[XATOM_NET_WM_NAME], utf8},
+		{XA_WM_NAME, XA_STRING},
+		{XA_WM_NAME, utf8}
+	};
+	memcpy(candidates, tmp, sizeof(tmp));
+}
+
+static void send_name_requests(struct x_connection *c, Window win,
+			       struct x_prop_request reqs[NAME_CANDIDATES])
+{
+	Atom candidates[NAME_CANDIDATES][2];
+	size_t i;
+
+	get_name_candidates(c, candidates);
+	for (i = 0; i < NAME_CANDIDATES; ++i)
+		x_send_prop_request(c, &reqs[i], win, candidates[i][0],
+				    candidates[i][1]);
+}
+
+/* picks the best name, returns 0 if there is none (atom and type are set to
+ * None) */
+static char *get_name_replies(struct x_connection *c,
+			      struct x_prop_request reqs[NAME_CANDIDATES],
+			      Atom *atom, Atom *atype)
+{
+	char *name = 0;
+	size_t i;
+
+	*atom = None;
+	*atype = None;
+	for (i = 0; i < NAME_CANDIDATES; ++i) {
+		if (name) {
+			x_discard_prop_request(c, &reqs[i]);
+			continue;
+		}
+		name = x_get_prop_reply(c, &reqs[i], 0);
+		if (name) {
+			*atom = reqs[i].prop;
+			*atype = reqs[i].type;
+		}
+	}
+	return name;
+}
+
 void x_realloc_window_name(struct strbuf *sb, struct x_connection *c,
 			   Window win, Atom *atom, Atom *atype)
 {
+	struct x_prop_request reqs[NAME_CANDIDATES];
+	struct x_prop_request r;
 	char *name = 0;
+
 	if (*atom != None) {
 		/* fast path */
-		name = x_get_prop_data(c, win, *atom, *atype, 0);
+		x_send_prop_request(c, &r, win, *atom, *atype);
+		name = x_get_prop_reply(c, &r, 0);
 		if (name)
 			goto name_here;
 	}
-	/****************/
-	*atype = c->atoms[XATOM_UTF8_STRING];
-	*atom = c->atoms[XATOM_NET_WM_VISIBLE_ICON_NAME];
-
-	name = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_VISIBLE_ICON_NAME],
-			c->atoms[XATOM_UTF8_STRING], 0);
-	if (name)
-		goto name_here;
-	/****************/
-	*atype = c->atoms[XATOM_UTF8_STRING];
-	*atom = c->atoms[XATOM_NET_WM_ICON_NAME];
-
-	name = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_ICON_NAME],
-			c->atoms[XATOM_UTF8_STRING], 0);
-	if (name)
-		goto name_here;
-	/****************/
-	*atype = XA_STRING;
-	*atom = XA_WM_ICON_NAME;
-
-	name = x_get_prop_data(c, win, XA_WM_ICON_NAME, XA_STRING, 0);
-	if (name)
-		goto name_here;
-	/****************/
-	*atype = c->atoms[XATOM_UTF8_STRING];
-	*atom = XA_WM_ICON_NAME;
-
-	name = x_get_prop_data(c, win, XA_WM_ICON_NAME, c->atoms[XATOM_UTF8_STRING], 0);
-	if (name)
-		goto name_here;
-	/****************/
-	*atype = c->atoms[XATOM_UTF8_STRING];
-	*atom = c->atoms[XATOM_NET_WM_VISIBLE_NAME];
-
-	name = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_VISIBLE_NAME],
-			c->atoms[XATOM_UTF8_STRING], 0);
-	if (name)
-		goto name_here;
-	/****************/
-	*atype = c->atoms[XATOM_UTF8_STRING];
-	*atom = c->atoms[XATOM_NET_WM_NAME];
-
-	name = x_get_prop_data(c, win, c->atoms[XATOM_NET_WM_NAME],
-			c->atoms[XATOM_UTF8_STRING], 0);
-	if (name)
-		goto name_here;
-	/****************/
-	*atype = XA_STRING;
-	*atom = XA_WM_NAME;
-
-	name = x_get_prop_data(c, win, XA_WM_NAME, XA_STRING, 0);
-	if (name)
-		goto name_here;
-	/****************/
-	*atype = c->atoms[XATOM_UTF8_STRING];
-	*atom = XA_WM_NAME;
-
-	name = x_get_prop_data(c, win, XA_WM_NAME, c->atoms[XATOM_UTF8_STRING], 0);
-	if (name)
-		goto name_here;
-	else {
-		*atom = None;
-		*atype = None;
+
+	/* ask for all candidates at once and pick the best one */
+	send_name_requests(c, win, reqs);
+	name = get_name_replies(c, reqs, atom, atype);
+	if (!name) {
 		strbuf_assign(sb, "<unknown>");
 		return;
 	}
-	/****************/
 name_here:
 	strbuf_assign(sb, name);
-	XFree(name);
+	xfree(name);
 }
 
 void x_send_netwm_message(struct x_connection *c, Window win,
@@ -616,7 +701,88 @@ void x_translate_coordinates(struct x_connection *c, int x, int y,
 			     int *xout, int *yout, Window win)
 {
 	Window tmpwin;
+	struct trace_reply tr;
+
+	if (trace_mode == TRACE_REPLAY) {
+		if (trace_read_reply(TRACE_OP_COORDINATES, win, &tr) == 0) {
+			*xout = tr.v[0] + x;
+			*yout = tr.v[1] + y;
+		} else {
+			*xout = x;
+			*yout = y;
+		}
+		return;
+	}
+
+	PROFILE_ROUND_TRIP("x_translate_coordinates");
 	XTranslateCoordinates(c->dpy, win, c->root, x, y, xout, yout, &tmpwin);
+
+	if (trace_mode == TRACE_RECORD) {
+		tr = (struct trace_reply){1, {*xout - x, *yout - y, 0, 0}};
+		trace_write_reply(TRACE_OP_COORDINATES, win, &tr);
+	}
+}
+
+int x_get_window_attributes(struct x_connection *c, Window win,
+			    XWindowAttributes *attrs)
+{
+	struct trace_reply tr;
+	int status;
+
+	if (trace_mode == TRACE_REPLAY) {
+		CLEAR_STRUCT(attrs);
+		if (trace_read_reply(TRACE_OP_ATTRIBUTES, win, &tr) != 0)
+			return 0;
+		attrs->width = tr.v[0];
+		attrs->height = tr.v[1];
+		attrs->your_event_mask = tr.v[2];
+		attrs->map_state = tr.v[3];
+		return tr.status;
+	}
+
+	PROFILE_ROUND_TRIP("x_get_window_attributes");
+	status = XGetWindowAttributes(c->dpy, win, attrs);
+
+	if (trace_mode == TRACE_RECORD) {
+		tr = (struct trace_reply){status, {0, 0, 0, 0}};
+		if (status) {
+			tr.v[0] = attrs->width;
+			tr.v[1] = attrs->height;
+			tr.v[2] = attrs->your_event_mask;
+			tr.v[3] = attrs->map_state;
+		}
+		trace_write_reply(TRACE_OP_ATTRIBUTES, win, &tr);
+	}
+	return status;
+}
+
+int x_get_geometry(struct x_connection *c, Drawable d, unsigned int *w,
+		   unsigned int *h, unsigned int *depth)
+{
+	Window root_ret;
+	int x, y;
+	unsigned int bw;
+	struct trace_reply tr;
+	int status;
+
+	*w = *h = *depth = 0;
+	if (trace_mode == TRACE_REPLAY) {
+		if (trace_read_reply(TRACE_OP_GEOMETRY, d, &tr) != 0)
+			return 0;
+		*w = tr.v[0];
+		*h = tr.v[1];
+		*depth = tr.v[2];
+		return tr.status;
+	}
+
+	PROFILE_ROUND_TRIP("x_get_geometry");
+	status = XGetGeometry(c->dpy, d, &root_ret, &x, &y, w, h, &bw, depth);
+
+	if (trace_mode == TRACE_RECORD) {
+		tr = (struct trace_reply){status, {*w, *h, *depth, 0}};
+		trace_write_reply(TRACE_OP_GEOMETRY, d, &tr);
+	}
+	return status;
 }
 
 /**************************************************************************
@@ -624,6 +790,7 @@ void x_translate_coordinates(struct x_connection *c, int x, int y,
 **************************************************************************/
 
 static int trapped_error;
+static int error_trap_active;
 static int (*old_error_handler)(Display*, XErrorEvent*);
 
 static int X_error_trap(Display *dpy, XErrorEvent *error)
@@ -635,12 +802,658 @@ static int X_error_trap(Display *dpy, XErrorEvent *error)
 void x_set_error_trap()
 {
 	old_error_handler = XSetErrorHandler(X_error_trap);
+	error_trap_active = 1;
 }
 
 int x_done_error_trap()
 {
 	XSetErrorHandler(old_error_handler);
+	error_trap_active = 0;
 	int ret = trapped_error;
 	trapped_error = 0;
 	return ret;
 }
+
+/* errors of asynchronous requests are reported with replies instead of
+ * error handlers, handle them the same way */
+static void async_error(struct x_connection *c, int error_code, XID resource)
+{
+	if (error_trap_active) {
+		trapped_error = -1;
+		return;
+	}
+
+	char buf[1024];
+	if (error_code == BadWindow)
+		return;
+	XGetErrorText(c->dpy, error_code, buf, sizeof(buf));
+	XWARNING("X error: %s (resource id: %d)", buf, (int)resource);
+}
+
+/**************************************************************************
+  Asynchronous property requests
+**************************************************************************/
+
+/* Data is converted to the Xlib representation (format 32 items are longs,
+ * format 16 items are shorts). The tail is zeroed, so that strings are
+ * NUL-terminated and data[0] is valid even for empty properties.
+ */
+static void *alloc_prop_data(int format, unsigned long items, size_t *size)
+{
+	*size = prop_item_size(format);
+	return xmallocz(items * *size + sizeof(long));
+}
+
+#ifdef HAVE_XCB
+/*
+ * Wait for a reply, when profiling, count it as a round trip only if it
+ * wasn't already received along with the replies to earlier requests.
+ */
+static void *wait_for_reply(xcb_connection_t *xc, unsigned int sequence,
+			    xcb_generic_error_t **err, const char *site)
+{
+	if (profile_enabled) {
+		void *rep = 0;
+		if (xcb_poll_for_reply(xc, sequence, &rep, err))
+			return rep;
+		profile_round_trip(site);
+	}
+	return xcb_wait_for_reply(xc, sequence, err);
+}
+#endif
+
+void x_send_prop_range_request(struct x_connection *c,
+			       struct x_prop_request *r, Window win, Atom prop,
+			       Atom type, long offset, long length)
+{
+	r->win = win;
+	r->prop = prop;
+	r->type = type;
+	r->offset = offset;
+	r->length = length;
+	r->sequence = 0;
+	r->items_after = 0;
+	if (trace_mode == TRACE_REPLAY)
+		return;
+#ifdef HAVE_XCB
+	xcb_connection_t *xc = XGetXCBConnection(c->dpy);
+	r->sequence = xcb_get_property(xc, 0, win, prop, type,
+				       offset, length).sequence;
+#endif
+}
+
+void x_send_prop_request(struct x_connection *c, struct x_prop_request *r,
+			 Window win, Atom prop, Atom type)
+{
+	x_send_prop_range_request(c, r, win, prop, type, 0, 0x7fffffff);
+}
+
+#ifdef HAVE_XCB
+static void *get_prop_reply(struct x_connection *c, struct x_prop_request *r,
+			    int *items, int *format)
+{
+	xcb_connection_t *xc = XGetXCBConnection(c->dpy);
+	xcb_generic_error_t *err = 0;
+	xcb_get_property_reply_t *rep;
+
+	if (items)
+		*items = 0;
+
+	rep = wait_for_reply(xc, r->sequence, &err, "x_get_prop_reply");
+	if (err) {
+		async_error(c, err->error_code, r->win);
+		free(err);
+	}
+	if (!rep)
+		return 0;
+
+	if (items)
+		*items = rep->value_len;
+	if (rep->type != r->type || rep->type == None) {
+		free(rep);
+		return 0;
+	}
+	*format = rep->format;
+	if (rep->format)
+		r->items_after = rep->bytes_after / (rep->format / 8);
+
+	size_t i, size;
+	unsigned long n = rep->value_len;
+	void *value = xcb_get_property_value(rep);
+	void *data = alloc_prop_data(rep->format, n, &size);
+	switch (rep->format) {
+	case 32:
+		for (i = 0; i < n; ++i)
+			((long*)data)[i] = ((uint32_t*)value)[i];
+		break;
+	case 16:
+		for (i = 0; i < n; ++i)
+			((short*)data)[i] = ((uint16_t*)value)[i];
+		break;
+	default:
+		memcpy(data, value, n);
+		break;
+	}
+	free(rep);
+	return data;
+}
+
+void x_discard_prop_request(struct x_connection *c, struct x_prop_request *r)
+{
+	if (r->sequence)
+		xcb_discard_reply(XGetXCBConnection(c->dpy), r->sequence);
+}
+#else
+static void *get_prop_reply(struct x_connection *c, struct x_prop_request *r,
+			    int *items, int *format)
+{
+	Atom type_ret;
+	int format_ret;
+	unsigned long items_ret;
+	unsigned long after_ret;
+	unsigned char *prop_data = 0;
+
+	PROFILE_ROUND_TRIP("x_get_prop_reply");
+	XGetWindowProperty(c->dpy, r->win, r->prop, r->offset, r->length,
+			False, r->type, &type_ret, &format_ret, &items_ret,
+			&after_ret, &prop_data);
+	if (items)
+		*items = items_ret;
+	if (r->type != type_ret || type_ret == None) {
+		if (prop_data)
+			XFree(prop_data);
+		return 0;
+	}
+	*format = format_ret;
+	if (format_ret)
+		r->items_after = after_ret / (format_ret / 8);
+
+	size_t size;
+	void *data = alloc_prop_data(format_ret, items_ret, &size);
+	if (prop_data) {
+		memcpy(data, prop_data, items_ret * size);
+		XFree(prop_data);
+	}
+	return data;
+}
+
+void x_discard_prop_request(struct x_connection *c, struct x_prop_request *r)
+{
+	/* nothing was sent */
+}
+#endif
+
+void *x_get_prop_reply(struct x_connection *c, struct x_prop_request *r,
+		       int *items)
+{
+	struct trace_prop tp = {0, 0, 0, 0, 0};
+	void *data;
+	int num = 0;
+
+	if (trace_mode == TRACE_REPLAY) {
+		trace_read_prop(r->win, r->prop, &tp);
+		if (items)
+			*items = tp.items;
+		if (!tp.data)
+			return 0;
+		r->items_after = tp.items_after;
+		data = alloc_prop_data(tp.format, tp.items, &tp.size);
+		memcpy(data, tp.data, tp.items * tp.size);
+		return data;
+	}
+
+	data = get_prop_reply(c, r, &num, &tp.format);
+	if (items)
+		*items = num;
+
+	if (trace_mode == TRACE_RECORD) {
+		tp.items = num;
+		tp.items_after = r->items_after;
+		tp.size = num * prop_item_size(tp.format);
+		tp.data = data;
+		trace_write_prop(r->win, r->prop, &tp);
+	}
+	return data;
+}
+
+/**************************************************************************
+  Bulk window scan
+**************************************************************************/
+
+struct window_scan {
+	unsigned int attrs_sequence; /* XCB cookies */
+	unsigned int geom_sequence;
+	unsigned int translate_sequence;
+
+	struct x_prop_request type;
+	struct x_prop_request wm_state;
+	struct x_prop_request state;
+	struct x_prop_request hints;
+	struct x_prop_request desktop;
+	struct x_prop_request extents;
+	struct x_prop_request names[NAME_CANDIDATES];
+};
+
+#ifdef HAVE_XCB
+static void scan_send_attrs(struct x_connection *c, struct window_scan *ws,
+			    Window win)
+{
+	xcb_connection_t *xc = XGetXCBConnection(c->dpy);
+	ws->attrs_sequence = xcb_get_window_attributes(xc, win).sequence;
+}
+
+static int scan_get_event_mask(struct x_connection *c, struct window_scan *ws,
+			       Window win, long *mask)
+{
+	xcb_connection_t *xc = XGetXCBConnection(c->dpy);
+	xcb_generic_error_t *err = 0;
+	xcb_get_window_attributes_reply_t *rep;
+
+	rep = wait_for_reply(xc, ws->attrs_sequence, &err,
+			     "x_scan_windows (attributes)");
+	if (err) {
+		async_error(c, err->error_code, win);
+		free(err);
+	}
+	if (!rep)
+		return -1;
+	*mask = rep->your_event_mask;
+	free(rep);
+	return 0;
+}
+
+static void scan_send_geometry(struct x_connection *c, struct window_scan *ws,
+			       Window win)
+{
+	xcb_connection_t *xc = XGetXCBConnection(c->dpy);
+	ws->geom_sequence = xcb_get_geometry(xc, win).sequence;
+	ws->translate_sequence = xcb_translate_coordinates(xc, win, c->root,
+							   0, 0).sequence;
+}
+
+static void scan_get_geometry(struct x_connection *c, struct window_scan *ws,
+			      struct x_window_info *info)
+{
+	xcb_connection_t *xc = XGetXCBConnection(c->dpy);
+	xcb_generic_error_t *err = 0;
+
+	xcb_get_geometry_reply_t *geom = wait_for_reply(xc, ws->geom_sequence,
+			&err, "x_scan_windows (geometry)");
+	if (err) {
+		async_error(c, err->error_code, info->win);
+		free(err);
+		err = 0;
+	}
+	if (geom) {
+		info->width = geom->width;
+		info->height = geom->height;
+		free(geom);
+	}
+
+	xcb_translate_coordinates_reply_t *tr = wait_for_reply(xc,
+			ws->translate_sequence, &err,
+			"x_scan_windows (coordinates)");
+	if (err) {
+		async_error(c, err->error_code, info->win);
+		free(err);
+	}
+	if (tr) {
+		info->x = tr->dst_x;
+		info->y = tr->dst_y;
+		free(tr);
+	}
+}
+#else
+static void scan_send_attrs(struct x_connection *c, struct window_scan *ws,
+			    Window win)
+{
+	/* nothing, synchronous fallback */
+}
+
+static int scan_get_event_mask(struct x_connection *c, struct window_scan *ws,
+			       Window win, long *mask)
+{
+	XWindowAttributes winattrs;
+	PROFILE_ROUND_TRIP("x_scan_windows (attributes)");
+	if (!XGetWindowAttributes(c->dpy, win, &winattrs))
+		return -1;
+	*mask = winattrs.your_event_mask;
+	return 0;
+}
+
+static void scan_send_geometry(struct x_connection *c, struct window_scan *ws,
+			       Window win)
+{
+	/* nothing, synchronous fallback */
+}
+
+static void scan_get_geometry(struct x_connection *c, struct window_scan *ws,
+			      struct x_window_info *info)
+{
+	XWindowAttributes winattrs;
+	Window tmpwin;
+
+	PROFILE_ROUND_TRIP("x_scan_windows (geometry)");
+	if (XGetWindowAttributes(c->dpy, info->win, &winattrs)) {
+		info->width = winattrs.width;
+		info->height = winattrs.height;
+	}
+	PROFILE_ROUND_TRIP("x_scan_windows (coordinates)");
+	XTranslateCoordinates(c->dpy, info->win, c->root, 0, 0,
+			      &info->x, &info->y, &tmpwin);
+}
+#endif
+
+static int scan_event_mask(struct x_connection *c, struct window_scan *ws,
+			   Window win, long *mask)
+{
+	struct trace_reply tr;
+	int ret;
+
+	if (trace_mode == TRACE_REPLAY) {
+		if (trace_read_reply(TRACE_OP_EVENT_MASK, win, &tr) != 0)
+			return -1;
+		*mask = tr.v[0];
+		return tr.status;
+	}
+
+	ret = scan_get_event_mask(c, ws, win, mask);
+	if (trace_mode == TRACE_RECORD) {
+		tr = (struct trace_reply){ret, {(ret == 0) ? *mask : 0, 0, 0, 0}};
+		trace_write_reply(TRACE_OP_EVENT_MASK, win, &tr);
+	}
+	return ret;
+}
+
+static void scan_geometry(struct x_connection *c, struct window_scan *ws,
+			  struct x_window_info *info)
+{
+	struct trace_reply tr;
+
+	if (trace_mode == TRACE_REPLAY) {
+		if (trace_read_reply(TRACE_OP_SCAN_GEOMETRY, info->win, &tr) != 0)
+			return;
+		info->x = tr.v[0];
+		info->y = tr.v[1];
+		info->width = tr.v[2];
+		info->height = tr.v[3];
+		return;
+	}
+
+	scan_get_geometry(c, ws, info);
+	if (trace_mode == TRACE_RECORD) {
+		tr = (struct trace_reply){1, {info->x, info->y,
+			info->width, info->height}};
+		trace_write_reply(TRACE_OP_SCAN_GEOMETRY, info->win, &tr);
+	}
+}
+
+static int atoms_contain(const Atom *atoms, int n, Atom atom)
+{
+	while (n) {
+		n--;
+		if (atoms[n] == atom)
+			return 1;
+	}
+	return 0;
+}
+
+static void scan_get_replies(struct x_connection *c, struct window_scan *ws,
+			     struct x_window_info *info, unsigned int flags)
+{
+	Atom *atoms;
+	long *data;
+	int num;
+
+	scan_geometry(c, ws, info);
+
+	/* visibility */
+	info->visible_on_panel = 1;
+	atoms = x_get_prop_reply(c, &ws->type, &num);
+	if (atoms) {
+		if (atoms_contain(atoms, num, c->atoms[XATOM_NET_WM_WINDOW_TYPE_DOCK]) ||
+		    atoms_contain(atoms, num, c->atoms[XATOM_NET_WM_WINDOW_TYPE_DESKTOP]))
+			info->visible_on_panel = 0;
+		xfree(atoms);
+	}
+
+	data = x_get_prop_reply(c, &ws->wm_state, 0);
+	if (data) {
+		if (data[0] == WithdrawnState)
+			info->visible_on_panel = 0;
+		xfree(data);
+	}
+
+	info->visible_on_screen = info->visible_on_panel;
+	atoms = x_get_prop_reply(c, &ws->state, &num);
+	if (atoms) {
+		if (atoms_contain(atoms, num, c->atoms[XATOM_NET_WM_STATE_SKIP_TASKBAR]))
+			info->visible_on_panel = info->visible_on_screen = 0;
+		if (atoms_contain(atoms, num, c->atoms[XATOM_NET_WM_STATE_HIDDEN]))
+			info->visible_on_screen = 0;
+		if (atoms_contain(atoms, num, c->atoms[XATOM_NET_WM_STATE_DEMANDS_ATTENTION]))
+			info->demands_attention = 1;
+		xfree(atoms);
+	}
+
+	data = x_get_prop_reply(c, &ws->hints, &num);
+	if (data) {
+		if (num > 0 && (data[0] & XUrgencyHint))
+			info->demands_attention = 1;
+		xfree(data);
+	}
+
+	data = x_get_prop_reply(c, &ws->desktop, 0);
+	if (data) {
+		info->desktop = (int)data[0];
+		xfree(data);
+	}
+
+	if (flags & X_SCAN_FRAME_EXTENTS) {
+		data = x_get_prop_reply(c, &ws->extents, &num);
+		if (data) {
+			if (num >= 4)
+				memcpy(info->frame_extents, data,
+				       sizeof(info->frame_extents));
+			xfree(data);
+		}
+	}
+
+	if (flags & X_SCAN_NAME)
+		info->name = get_name_replies(c, ws->names, &info->name_atom,
+					      &info->name_type_atom);
+}
+
+void x_scan_windows(struct x_connection *c, const Window *wins, size_t n,
+		    struct x_window_info *infos, unsigned int flags)
+{
+	struct window_scan *scans = xmallocz(sizeof(struct window_scan) * n);
+	size_t i;
+
+	memset(infos, 0, sizeof(struct x_window_info) * n);
+
+	/* event masks first, select input before reading the state, so that
+	 * we won't miss any changes */
+	for (i = 0; i < n && trace_mode != TRACE_REPLAY; ++i)
+		scan_send_attrs(c, &scans[i], wins[i]);
+
+	for (i = 0; i < n; ++i) {
+		struct x_window_info *info = &infos[i];
+		long mask;
+
+		info->win = wins[i];
+		if (scan_event_mask(c, &scans[i], wins[i], &mask) != 0)
+			continue;
+		XSelectInput(c->dpy, wins[i],
+			     mask | PropertyChangeMask | StructureNotifyMask);
+		info->alive = 1;
+	}
+
+	/* everything else */
+	for (i = 0; i < n; ++i) {
+		struct window_scan *ws = &scans[i];
+		Window win = wins[i];
+		if (!infos[i].alive)
+			continue;
+
+		if (trace_mode != TRACE_REPLAY)
+			scan_send_geometry(c, ws, win);
+		x_send_prop_request(c, &ws->type, win,
+				    c->atoms[XATOM_NET_WM_WINDOW_TYPE], XA_ATOM);
+		x_send_prop_request(c, &ws->wm_state, win,
+				    c->atoms[XATOM_WM_STATE],
+				    c->atoms[XATOM_WM_STATE]);
+		x_send_prop_request(c, &ws->state, win,
+				    c->atoms[XATOM_NET_WM_STATE], XA_ATOM);
+		x_send_prop_request(c, &ws->hints, win, XA_WM_HINTS, XA_WM_HINTS);
+		x_send_prop_request(c, &ws->desktop, win,
+				    c->atoms[XATOM_NET_WM_DESKTOP], XA_CARDINAL);
+		if (flags & X_SCAN_FRAME_EXTENTS)
+			x_send_prop_request(c, &ws->extents, win,
+					    c->atoms[XATOM_NET_FRAME_EXTENTS],
+					    XA_CARDINAL);
+		if (flags & X_SCAN_NAME)
+			send_name_requests(c, win, ws->names);
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (infos[i].alive)
+			scan_get_replies(c, &scans[i], &infos[i], flags);
+	}
+
+	xfree(scans);
+}
+
+void x_free_window_infos(struct x_window_info *infos, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		if (infos[i].name)
+			xfree(infos[i].name);
+	}
+}
+
+/**************************************************************************
+  Client-side images
+**************************************************************************/
+
+#ifdef HAVE_XSHM
+static int create_shared_image(struct x_connection *c, struct x_image *img,
+			       Visual *visual, int depth,
+			       unsigned int w, unsigned int h)
+{
+	XImage *xi = XShmCreateImage(c->dpy, visual, depth, ZPixmap, 0,
+				     &img->shminfo, w, h);
+	if (!xi)
+		return -1;
+
+	img->shminfo.shmid = shmget(IPC_PRIVATE, xi->bytes_per_line * h,
+				    IPC_CREAT | 0600);
+	if (img->shminfo.shmid < 0) {
+		XDestroyImage(xi);
+		return -1;
+	}
+	img->shminfo.shmaddr = xi->data = shmat(img->shminfo.shmid, 0, 0);
+	img->shminfo.readOnly = False;
+
+	/* attach fails on remote displays, it's the only way to find out */
+	if (xi->data != (char*)-1) {
+		x_set_error_trap();
+		XShmAttach(c->dpy, &img->shminfo);
+		XSync(c->dpy, False);
+		if (x_done_error_trap() == 0) {
+			/* freed by the system after both sides detach */
+			shmctl(img->shminfo.shmid, IPC_RMID, 0);
+			img->ximage = xi;
+			img->shared = 1;
+			return 0;
+		}
+		shmdt(xi->data);
+	}
+
+	shmctl(img->shminfo.shmid, IPC_RMID, 0);
+	xi->data = 0;
+	XDestroyImage(xi);
+	c->shm_available = 0;
+	return -1;
+}
+#endif
+
+struct x_image *x_create_image(struct x_connection *c, Visual *visual,
+			       int depth, unsigned int w, unsigned int h)
+{
+	struct x_image *img = xmallocz(sizeof(struct x_image));
+	XImage *xi;
+	char *data;
+
+#ifdef HAVE_XSHM
+	if (c->shm_available &&
+	    create_shared_image(c, img, visual, depth, w, h) == 0)
+		return img;
+#endif
+	/* data is freed by XDestroyImage, hence malloc */
+	xi = XCreateImage(c->dpy, visual, depth, ZPixmap, 0, 0, w, h, 32, 0);
+	ENSURE(xi != 0, "Failed to create XImage");
+	data = malloc(xi->bytes_per_line * h);
+	ENSURE(data != 0, "Out of memory");
+	xi->data = data;
+	img->ximage = xi;
+	return img;
+}
+
+void x_destroy_image(struct x_connection *c, struct x_image *img)
+{
+#ifdef HAVE_XSHM
+	if (img->shared) {
+		XShmDetach(c->dpy, &img->shminfo);
+		shmdt(img->shminfo.shmaddr);
+		img->ximage->data = 0;
+	}
+#endif
+	XDestroyImage(img->ximage);
+	xfree(img);
+}
+
+int x_get_image(struct x_connection *c, Drawable d, struct x_image *img,
+		int x, int y)
+{
+	XImage *xi = img->ximage;
+	int ok;
+
+	PROFILE_ROUND_TRIP("x_get_image");
+	x_set_error_trap();
+#ifdef HAVE_XSHM
+	if (img->shared) {
+		XShmGetImage(c->dpy, d, xi, x, y, AllPlanes);
+		XSync(c->dpy, False);
+	} else
+#endif
+	XGetSubImage(c->dpy, d, x, y, xi->width, xi->height, AllPlanes,
+		     ZPixmap, xi, 0, 0);
+	ok = (x_done_error_trap() == 0);
+	return ok ? 0 : -1;
+}
+
+unsigned long x_put_image(struct x_connection *c, Drawable d, GC gc,
+			  struct x_image *img, int x, int y,
+			  unsigned int w, unsigned int h)
+{
+#ifdef HAVE_XSHM
+	if (img->shared) {
+		unsigned long serial = NextRequest(c->dpy);
+		XShmPutImage(c->dpy, d, gc, img->ximage, x, y, x, y, w, h, True);
+		return serial;
+	}
+#endif
+	XPutImage(c->dpy, d, gc, img->ximage, x, y, x, y, w, h);
+	return 0;
+}
+
+unsigned long x_shm_completion_serial(struct x_connection *c, XEvent *e)
+{
+#ifdef HAVE_XSHM
+	if (c->shm_available && e->type == c->shm_event_base + ShmCompletion)
+		return e->xany.serial;
+#endif
+	return 0;
+}
@@ -16,6 +16,20 @@
  #include <X11/extensions/Xrandr.h>
 #endif
 
+#ifdef HAVE_XCB
+ #include <X11/Xlib-xcb.h>
+#endif
+
+#ifdef HAVE_XFIXES
+ #include <X11/extensions/Xfixes.h>
+#endif
+
+#ifdef HAVE_XSHM
+ #include <sys/ipc.h>
+ #include <sys/shm.h>
+ #include <X11/extensions/XShm.h>
+#endif
+
 enum x_atom {
 	XATOM_WM_STATE,
 	XATOM_NET_DESKTOP_NAMES,
@@ -85,6 +99,14 @@ struct x_connection {
 	Window root;
 	Pixmap root_pixmap;
 
+	/* MIT-SHM is usable, cleared if the server can't attach segments */
+	int shm_available;
+	int shm_event_base;
+
+	/* _NET_WM_CM_S<screen>, zero event base if XFixes is unavailable */
+	Atom cm_selection;
+	int xfixes_event_base;
+
 	Atom atoms[XATOM_COUNT];
 };
 
@@ -92,6 +114,12 @@ void x_connect(struct x_connection *c, const char *display);
 void x_disconnect(struct x_connection *c);
 void x_update_monitors_info(struct x_connection *c);
 
+/* returns zero if a 32 bit visual is available, sets argb_* fields */
+int x_find_argb_visual(struct x_connection *c);
+int x_composite_manager_running(struct x_connection *c);
+/* XFixes notification about _NET_WM_CM_S<screen> owner change */
+int x_is_composite_manager_event(struct x_connection *c, XEvent *e);
+
 /*
  * default window is (ommiting 5 parameters):
  *  parent = c->root
@@ -119,6 +147,38 @@ Window x_create_default_embedder(struct x_connection *c, Window parent,
 void *x_get_prop_data(struct x_connection *c, Window win, Atom prop,
 		      Atom type, int *items);
 
+/*
+ * Asynchronous property requests. Each request sent with
+ * x_send_prop_request must be finished with either x_get_prop_reply or
+ * x_discard_prop_request. Sending a bunch of requests before asking for
+ * the first reply costs a single round trip (with XCB, otherwise it falls
+ * back to synchronous requests).
+ */
+struct x_prop_request {
+	Window win;
+	Atom prop;
+	Atom type;
+	long offset; /* in 32 bit units, as in XGetWindowProperty */
+	long length;
+	unsigned int sequence; /* XCB cookie */
+
+	/* filled by x_get_prop_reply: items left past the requested range */
+	unsigned long items_after;
+};
+
+void x_send_prop_request(struct x_connection *c, struct x_prop_request *r,
+			 Window win, Atom prop, Atom type);
+/* requests only "length" 32 bit units of the property at "offset" */
+void x_send_prop_range_request(struct x_connection *c,
+			       struct x_prop_request *r, Window win, Atom prop,
+			       Atom type, long offset, long length);
+
+/* same as x_get_prop_data, but allocated with xmalloc, should be released
+ * with xfree */
+void *x_get_prop_reply(struct x_connection *c, struct x_prop_request *r,
+		       int *items);
+void x_discard_prop_request(struct x_connection *c, struct x_prop_request *r);
+
 int x_get_prop_int(struct x_connection *c, Window win, Atom at);
 Window x_get_prop_window(struct x_connection *c, Window win, Atom at);
 Pixmap x_get_prop_pixmap(struct x_connection *c, Window win, Atom at);
@@ -139,6 +199,43 @@ int x_is_window_demands_attention(struct x_connection *c, Window win);
 void x_realloc_window_name(struct strbuf *sb, struct x_connection *c,
 			   Window win, Atom *atom, Atom *atype);
 
+/*
+ * Bulk window scan, fetches state of many windows at once, requests are
+ * pipelined for all windows. It also selects PropertyChangeMask and
+ * StructureNotifyMask on each window (in addition to already selected
+ * events). Windows which don't exist are marked with "alive == 0".
+ */
+#define X_SCAN_NAME (1 << 0)
+#define X_SCAN_FRAME_EXTENTS (1 << 1)
+
+struct x_window_info {
+	Window win;
+	int alive;
+
+	/* position relative to the root window and size */
+	int x;
+	int y;
+	int width;
+	int height;
+
+	int desktop;
+	int visible_on_panel;
+	int visible_on_screen;
+	int demands_attention;
+
+	/* X_SCAN_FRAME_EXTENTS: left, right, top, bottom */
+	long frame_extents[4];
+
+	/* X_SCAN_NAME: allocated with xmalloc, 0 if there is no name */
+	char *name;
+	Atom name_atom;
+	Atom name_type_atom;
+};
+
+void x_scan_windows(struct x_connection *c, const Window *wins, size_t n,
+		    struct x_window_info *infos, unsigned int flags);
+void x_free_window_infos(struct x_window_info *infos, size_t n);
+
 void x_send_netwm_message(struct x_connection *c, Window win,
 			  Atom a, long l0, long l1, long l2, long l3, long l4);
 void x_send_dnd_message(struct x_connection *c, Window win,
@@ -146,6 +243,39 @@ void x_send_dnd_message(struct x_connection *c, Window win,
 void x_update_root_pmap(struct x_connection *c);
 void x_translate_coordinates(struct x_connection *c, int x, int y,
 			     int *xout, int *yout, Window win);
+/* synchronous, counted by the round trip profiler */
+int x_get_window_attributes(struct x_connection *c, Window win,
+			    XWindowAttributes *attrs);
+int x_get_geometry(struct x_connection *c, Drawable d, unsigned int *w,
+		   unsigned int *h, unsigned int *depth);
 
 void x_set_error_trap();
 int x_done_error_trap();
+
+/*
+ * Client-side image, shared with the X server via MIT-SHM when possible.
+ * x_get_image reads a part of the drawable at (x,y) of the image size,
+ * returns non-zero on error. x_put_image writes a rectangle of the image to
+ * the same position of the drawable. Shared puts are asynchronous, the
+ * server may read the image data until it sends ShmCompletion, x_put_image
+ * returns the request serial the event will carry (zero for non-shared
+ * images).
+ */
+struct x_image {
+	XImage *ximage;
+	int shared;
+#ifdef HAVE_XSHM
+	XShmSegmentInfo shminfo;
+#endif
+};
+
+struct x_image *x_create_image(struct x_connection *c, Visual *visual,
+			       int depth, unsigned int w, unsigned int h);
+void x_destroy_image(struct x_connection *c, struct x_image *img);
+int x_get_image(struct x_connection *c, Drawable d, struct x_image *img,
+		int x, int y);
+unsigned long x_put_image(struct x_connection *c, Drawable d, GC gc,
+			  struct x_image *img, int x, int y,
+			  unsigned int w, unsigned int h);
+/* returns the serial of the completed x_put_image or zero */
+unsigned long x_shm_completion_serial(struct x_connection *c, XEvent *e);